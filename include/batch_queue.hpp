@@ -0,0 +1,114 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+/* A bounded, lock-free queue for many producers and many consumers
+ * (D. Vyukov's array-based MPMC queue). Each cell carries a sequence number
+ * telling whether it is ready to be written or read in the current lap, so
+ * producers and consumers only contend on their own position counter.
+ *
+ * The capacity is rounded up to a power of two. */
+template <typename T>
+class BatchQueue {
+ private:
+  struct Cell {
+    std::atomic<size_t> sequence;
+    T data;
+  };
+
+  static constexpr size_t cache_line = 64;
+  std::unique_ptr<Cell[]> cells;
+  size_t mask;
+  alignas(cache_line) std::atomic<size_t> push_pos{0};
+  alignas(cache_line) std::atomic<size_t> pop_pos{0};
+
+  static size_t roundUpToPowerOfTwo(size_t n) {
+    size_t power = 2;
+    while (power < n) power *= 2;
+    return power;
+  }
+
+ public:
+  explicit BatchQueue(size_t capacity)
+      : cells(new Cell[roundUpToPowerOfTwo(capacity)]),
+        mask(roundUpToPowerOfTwo(capacity) - 1) {
+    for (size_t i = 0; i <= mask; ++i) {
+      cells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+  }
+
+  BatchQueue(const BatchQueue &) = delete;
+  BatchQueue &operator=(const BatchQueue &) = delete;
+
+  size_t capacity() const { return mask + 1; }
+
+  // Returns false, and leaves the data untouched, if the queue is full
+  bool tryPush(T &data) {
+    auto pos = push_pos.load(std::memory_order_relaxed);
+    Cell *cell;
+    while (true) {
+      cell = &cells[pos & mask];
+      const auto sequence = cell->sequence.load(std::memory_order_acquire);
+      const auto diff =
+          static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos);
+      if (diff == 0) {
+        if (push_pos.compare_exchange_weak(pos, pos + 1,
+                                           std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = push_pos.load(std::memory_order_relaxed);
+      }
+    }
+    cell->data = std::move(data);
+    cell->sequence.store(pos + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Returns false if the queue is empty
+  bool tryPop(T &data) {
+    auto pos = pop_pos.load(std::memory_order_relaxed);
+    Cell *cell;
+    while (true) {
+      cell = &cells[pos & mask];
+      const auto sequence = cell->sequence.load(std::memory_order_acquire);
+      const auto diff =
+          static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos + 1);
+      if (diff == 0) {
+        if (pop_pos.compare_exchange_weak(pos, pos + 1,
+                                          std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = pop_pos.load(std::memory_order_relaxed);
+      }
+    }
+    data = std::move(cell->data);
+    cell->sequence.store(pos + mask + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Pop up to max_items in FIFO order
+  std::vector<T> popBatch(size_t max_items) {
+    std::vector<T> batch;
+    T data;
+    while (batch.size() < max_items and tryPop(data)) {
+      batch.push_back(std::move(data));
+    }
+    return batch;
+  }
+
+  // Only a hint, since other threads may push or pop concurrently
+  bool empty() const {
+    return pop_pos.load(std::memory_order_acquire) >=
+           push_pos.load(std::memory_order_acquire);
+  }
+};
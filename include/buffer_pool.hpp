@@ -0,0 +1,96 @@
+#pragma once
+
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <utility>
+
+#include <CL/cl.hpp>
+
+/* Recycles device buffers between ConsistencyCheck instances and resolutions.
+ *
+ * A buffer is returned to the pool when the last handle to it goes away, and
+ * is handed out again for any request with the same flags and size class
+ * that fits into it. The size classes are powers of two, so that e.g. the
+ * residual buffers, which are half the size of the outputs, do not grow to
+ * the size of the outputs. New buffers are allocated with the largest size
+ * requested so far for their flags and size class, so cycling through a
+ * fixed set of resolutions stops allocating once the largest one has been
+ * seen. */
+class BufferPool : public std::enable_shared_from_this<BufferPool> {
+ public:
+  struct Entry {
+    cl::Buffer buffer;
+    size_t capacity;
+  };
+  using Handle = std::shared_ptr<const Entry>;
+
+ private:
+  // The flags and the base 2 logarithm of the requested size
+  using Key = std::pair<cl_mem_flags, size_t>;
+
+  cl::Context context;
+  std::mutex mutex;
+  // The unused buffers for each key, sorted by capacity
+  std::map<Key, std::multimap<size_t, cl::Buffer>> free_buffers;
+  std::map<Key, size_t> largest;
+  size_t allocations = 0;
+
+  static Key key(cl_mem_flags flags, size_t bytes) {
+    size_t size_class = 0;
+    while (bytes >>= 1) ++size_class;
+    return {flags, size_class};
+  }
+
+  void release(const Key &key, const Entry &entry) {
+    std::lock_guard<std::mutex> lock(mutex);
+    free_buffers[key].emplace(entry.capacity, entry.buffer);
+  }
+
+  Handle makeHandle(const Key &key, Entry *entry) {
+    std::weak_ptr<BufferPool> pool = shared_from_this();
+    return Handle(entry, [pool, key](const Entry *entry) {
+      if (const auto owner = pool.lock()) owner->release(key, *entry);
+      delete entry;
+    });
+  }
+
+ public:
+  explicit BufferPool(const cl::Context &context) : context(context) {}
+
+  // The number of buffers that had to be allocated on the device
+  size_t getAllocations() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return allocations;
+  }
+
+  /* Get a buffer of at least the specified size. Returns nullptr and sets
+   * err if the allocation fails. */
+  Handle acquire(cl_mem_flags flags, size_t bytes, cl_int *err = nullptr) {
+    const auto buffer_key = key(flags, bytes);
+    std::unique_lock<std::mutex> lock(mutex);
+    auto &buffers = free_buffers[buffer_key];
+    const auto it = buffers.lower_bound(bytes);
+    if (it != buffers.end()) {
+      auto entry = new Entry{it->second, it->first};
+      buffers.erase(it);
+      lock.unlock();
+      if (err) *err = CL_SUCCESS;
+      return makeHandle(buffer_key, entry);
+    }
+
+    // Every free buffer is too small, so give their memory back to the device
+    buffers.clear();
+    auto &capacity = largest[buffer_key];
+    capacity = std::max(capacity, bytes);
+    cl_int error = CL_SUCCESS;
+    cl::Buffer buffer(context, flags, capacity, nullptr, &error);
+    if (err) *err = error;
+    if (error != CL_SUCCESS) return nullptr;
+    ++allocations;
+    const auto allocated = capacity;
+    lock.unlock();
+    return makeHandle(buffer_key, new Entry{buffer, allocated});
+  }
+};
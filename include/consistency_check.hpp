@@ -1,95 +1,202 @@
 #pragma once
 
+#include <map>
 #include <memory>
 #include <tuple>
+#include <vector>
 
 #include <CL/cl.hpp>
 
 #include "cl_details.hpp"
-#include "cl_utils.hpp"
 #include "invalid_point.hpp"
-
-void consistencyCheck(short tol, short width, const short *const left_in,
-                      const short *const right_in, short *left_out,
-                      short *right_out);
+#include "kernel_generator.hpp"
+#include "reference_consistency_check.hpp"
+#include "runtime.hpp"
+#include "scoped_timer.hpp"
 
 class ConsistencyCheck {
  private:
-  cl::Context context;
+  Runtime *runtime;
+  cl::Device device;
   cl::Kernel kernel;
   cl::CommandQueue queue;
+  // The most recent kernel launch, for profiling
+  cl::Event kernel_event;
   uint16_t width = 0;
   uint16_t height = 0;
   uint32_t size = 0;
   uint16_t tolerance = 0;
-  cl::Buffer left_in_buf;
-  cl::Buffer right_in_buf;
-  cl::Buffer left_out_buf;
-  cl::Buffer right_out_buf;
-  GetGlobalId get_global_id;
+  BufferPool::Handle left_in_buf;
+  BufferPool::Handle right_in_buf;
+  BufferPool::Handle left_out_buf;
+  BufferPool::Handle right_out_buf;
+  BufferPool::Handle left_residual_buf;
+  BufferPool::Handle right_residual_buf;
+  // The index of the first local memory cache argument
+  cl_uint cache_arg = 0;
+  // With macros, each (width, tolerance) needs its own kernel. We keep all of
+  // the ones that we have used so that switching back to them is free.
+  std::map<std::pair<uint16_t, uint16_t>, cl::Kernel> kernels;
   size_t max_work_group_size;
   size_t work_group_size_multiple;
+  cl_ulong local_mem_size;
+  KernelFeatures features;
   bool using_macros = false;
 
- public:
-  ConsistencyCheck(const cl::Context &context, const cl::Device &device,
-                   cl::Kernel &kernel, uint16_t width, uint16_t height,
-                   uint16_t tolerance, bool using_macros)
-      : context(context),
-        kernel(kernel),
-        queue(context, device),  // CL_QUEUE_PROFILING_ENABLE),
-        tolerance(tolerance),
-        using_macros(using_macros) {
-    resize(width, height);
+  // Select the kernel for the current width and tolerance
+  bool selectKernel() {
+    const auto key = std::make_pair(using_macros ? width : 0,
+                                    using_macros ? tolerance : 0);
+    auto it = kernels.find(key);
+    if (it == kernels.end()) {
+      const auto new_kernel = runtime->createKernel(
+          features, buildOptions(width, tolerance, using_macros));
+      if (not new_kernel) return false;
+      it = kernels.emplace(key, *new_kernel).first;
+    }
+    kernel = it->second;
     kernel.getWorkGroupInfo(device, CL_KERNEL_WORK_GROUP_SIZE,
                             &max_work_group_size);
     kernel.getWorkGroupInfo(device,
                             CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE,
                             &work_group_size_multiple);
+    return true;
+  }
+
+  // Make sure that the buffers can hold the current image size. Buffers are
+  // only replaced when they are too small.
+  bool reserveBuffers() {
+    auto &pool = runtime->getBufferPool();
+    const auto reserve = [&](BufferPool::Handle &buf, cl_mem_flags flags,
+                             size_t bytes) {
+      if (buf and buf->capacity >= bytes) return true;
+      cl_int err = CL_SUCCESS;
+      buf = nullptr;
+      buf = pool.acquire(flags, bytes, &err);
+      return not showErrors(err);
+    };
+    const auto residual_bytes = residualBytes(width, height);
+    return reserve(left_in_buf, CL_MEM_READ_ONLY, size) and
+           reserve(right_in_buf, CL_MEM_READ_ONLY, size) and
+           reserve(left_out_buf, CL_MEM_WRITE_ONLY, size) and
+           reserve(right_out_buf, CL_MEM_WRITE_ONLY, size) and
+           (not features.residuals or
+            (reserve(left_residual_buf, CL_MEM_WRITE_ONLY, residual_bytes) and
+             reserve(right_residual_buf, CL_MEM_WRITE_ONLY, residual_bytes)));
+  }
+
+  void setArgs() {
+    cl_uint arg = 0;
+    if (not using_macros) {
+      showErrors(kernel.setArg<cl_int>(arg++, tolerance));
+      showErrors(kernel.setArg<cl_int>(arg++, width));
+    }
+    showErrors(kernel.setArg<cl_int>(arg++, width * height));
+    showErrors(kernel.setArg<cl::Buffer>(arg++, left_in_buf->buffer));
+    showErrors(kernel.setArg<cl::Buffer>(arg++, right_in_buf->buffer));
+    showErrors(kernel.setArg<cl::Buffer>(arg++, left_out_buf->buffer));
+    showErrors(kernel.setArg<cl::Buffer>(arg++, right_out_buf->buffer));
+    if (features.residuals) {
+      showErrors(kernel.setArg<cl::Buffer>(arg++, left_residual_buf->buffer));
+      showErrors(kernel.setArg<cl::Buffer>(arg++, right_residual_buf->buffer));
+    }
+    cache_arg = arg;
   }
 
+ public:
+  /* The kernel must have been created by the runtime for the specified
+   * features, width and tolerance. The runtime must outlive this object. The
+   * queue must belong to the device, and may be shared with other instances
+   * that are used from the same thread. Call resize() before using it. */
+  ConsistencyCheck(Runtime &runtime, size_t device_index,
+                   const cl::CommandQueue &queue, cl::Kernel &kernel,
+                   uint16_t width, uint16_t height, uint16_t tolerance,
+                   const KernelFeatures &features, bool using_macros)
+      : runtime(&runtime),
+        device(runtime.getDevices().at(device_index)),
+        queue(queue),
+        tolerance(tolerance),
+        features(features),
+        using_macros(using_macros) {
+    kernels.emplace(std::make_pair(using_macros ? width : 0,
+                                   using_macros ? tolerance : 0),
+                    kernel);
+    local_mem_size = device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>();
+  }
+
+  ConsistencyCheck(const ConsistencyCheck &) = default;
+  virtual ~ConsistencyCheck() = default;
+
   static auto imageBytes(int16_t width, int16_t height) {
     return 2 * width * height;
   }
 
-  void resize(uint16_t w, uint16_t h) {
-    if (width != w or height != h) {
-      // Allocate the buffers
+  static auto residualBytes(int16_t width, int16_t height) {
+    return width * height;
+  }
+
+  const KernelFeatures &getFeatures() const { return features; }
+  size_t getMaxWorkGroupSize() const { return max_work_group_size; }
+
+  /* Switch to another resolution. The device buffers are only reallocated if
+   * they are too small, and with macros, the kernel for each width is only
+   * built the first time that it is used. An empty resolution only selects
+   * the kernel, since there is nothing to reserve buffers for yet. */
+  bool resize(uint16_t w, uint16_t h) {
+    if (width != w or height != h or not kernel()) {
+      const auto width_changed = width != w or not kernel();
       width = w;
       height = h;
       size = imageBytes(width, height);
-      cl_int err = 0;
-      left_in_buf = cl::Buffer(context, CL_MEM_READ_ONLY, size, nullptr, &err);
-      if (showErrors(err)) return;
-      right_in_buf = cl::Buffer(context, CL_MEM_READ_ONLY, size, nullptr, &err);
-      if (showErrors(err)) return;
-      left_out_buf =
-          cl::Buffer(context, CL_MEM_WRITE_ONLY, size, nullptr, &err);
-      if (showErrors(err)) return;
-      right_out_buf =
-          cl::Buffer(context, CL_MEM_WRITE_ONLY, size, nullptr, &err);
-      if (showErrors(err)) return;
-
-      // Set the kernel arguments
-      cl_uint arg = 0;
-      if (not using_macros) {
-        showErrors(kernel.setArg<cl_short>(arg++, tolerance));
-        showErrors(kernel.setArg<cl_short>(arg++, width));
-        showErrors(kernel.setArg<cl_short>(arg++, width * height));
+      if ((size > 0 and not reserveBuffers()) or
+          (width_changed and not selectKernel())) {
+        // Some buffers may be missing, or the kernel may be built for another
+        // width, so make the next call start over
+        kernel = cl::Kernel();
+        width = 0;
+        height = 0;
+        size = 0;
+        return false;
       }
-      showErrors(kernel.setArg<cl::Buffer>(arg++, left_in_buf));
-      showErrors(kernel.setArg<cl::Buffer>(arg++, right_in_buf));
-      showErrors(kernel.setArg<cl::Buffer>(arg++, left_out_buf));
-      showErrors(kernel.setArg<cl::Buffer>(arg++, right_out_buf));
+      if (size > 0) setArgs();
     }
+    return true;
   }
 
-  void setTolerance(uint16_t tol) {
-    if (tolerance != tol) {
-      tolerance = tol;
-      if (not using_macros) {
-        kernel.setArg<cl_short>(0, tolerance);
+  bool setTolerance(uint16_t tol) {
+    if (tolerance == tol) return true;
+    const auto previous_tolerance = tolerance;
+    tolerance = tol;
+    if (size == 0) {
+      // There are no buffers to bind yet, or the last resize failed, so leave
+      // selecting the kernel and setting the arguments to the next resize
+      kernel = cl::Kernel();
+    } else if (using_macros) {
+      // The kernel built for the previous tolerance is still selected
+      if (not selectKernel()) {
+        tolerance = previous_tolerance;
+        return false;
       }
+      setArgs();
+    } else if (showErrors(kernel.setArg<cl_int>(0, tolerance))) {
+      tolerance = previous_tolerance;
+      return false;
+    }
+    return true;
+  }
+
+  // Fill the device output buffers with the specified value. The residual
+  // buffers receive its lower byte.
+  void fillOutputs(cl_ushort value) {
+    showErrors(queue.enqueueFillBuffer(left_out_buf->buffer, value, 0, size));
+    showErrors(queue.enqueueFillBuffer(right_out_buf->buffer, value, 0, size));
+    if (features.residuals) {
+      const auto residual_bytes = residualBytes(width, height);
+      const auto residual = static_cast<cl_uchar>(value);
+      showErrors(queue.enqueueFillBuffer(left_residual_buf->buffer, residual, 0,
+                                         residual_bytes));
+      showErrors(queue.enqueueFillBuffer(right_residual_buf->buffer, residual,
+                                         0, residual_bytes));
     }
   }
 
@@ -122,13 +229,67 @@ class ConsistencyCheck {
     return false;
   }
 
-  bool operator()(const cv::Mat &left_in, const cv::Mat &right_in,
-                  const cv::Mat &left_out, const cv::Mat &right_out,
-                  size_t work_group_size) {
+  // The residual images must be empty, or 8-bit images of the input size
+  bool areIncompatibleResiduals(const cv::Mat &image,
+                                const cv::Mat &left_residual,
+                                const cv::Mat &right_residual) const {
+    if (left_residual.empty() and right_residual.empty()) return false;
+    if (not features.residuals) {
+      std::cerr << "Residuals were requested, but " << features.name()
+                << " does not compute them" << std::endl;
+      return true;
+    }
+    for (const auto &residual : {left_residual, right_residual}) {
+      if (residual.empty()) continue;
+      if (residual.rows != image.rows or residual.cols != image.cols or
+          residual.type() != CV_8UC1) {
+        std::cerr << "The residuals must be 8-bit images of size "
+                  << image.rows << "x" << image.cols << std::endl;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  /* Switch to the resolution of the next images, waiting for the pending
+   * checks first if it changes. Buffers which are replaced go back to the
+   * pool, so the pending commands must not use them anymore. With macros,
+   * this may select another kernel with another maximum work group size.
+   *
+   * Returns false if the check can not run at this resolution. If any of the
+   * pending checks failed, this sets pending_failed, or if it is null,
+   * returns false as well, so that the failure is not lost. */
+  bool switchResolution(uint16_t w, uint16_t h,
+                        bool *pending_failed = nullptr) {
+    if ((w != width or h != height) and finish()) {
+      if (not pending_failed) return false;
+      *pending_failed = true;
+    }
+    return resize(w, h);
+  }
+
+  /* Enqueue the check without waiting for it. The images must stay alive
+   * and untouched until finish() returns. Consecutive calls may be batched
+   * this way, since the queue executes them in order. Either of the residual
+   * images may be empty, in which case it is not read. If only the left image
+   * is checked, the right output may be empty too. Returns true if any of
+   * the commands could not be enqueued, or if switching resolutions showed
+   * that a pending check failed. */
+  bool enqueue(const cv::Mat &left_in, const cv::Mat &right_in,
+               const cv::Mat &left_out, const cv::Mat &right_out,
+               const cv::Mat &left_residual, const cv::Mat &right_residual,
+               size_t work_group_size) {
     // Check all of the dimensions
+    const auto reads_right_out = features.both_sides or not right_out.empty();
     if (areIncompatible(left_in, "Left input", right_in, "right input") or
         areIncompatible(left_in, "Left input", left_out, "left output") or
-        areIncompatible(left_in, "Left input", right_out, "right output")) {
+        (reads_right_out and areIncompatible(left_in, "Left input", right_out,
+                                             "right output")) or
+        areIncompatibleResiduals(left_in, left_residual, right_residual)) {
+      return EXIT_FAILURE;
+    }
+
+    if (not switchResolution(left_in.cols, left_in.rows)) {
       return EXIT_FAILURE;
     }
 
@@ -150,50 +311,140 @@ class ConsistencyCheck {
     // }
 
     // Write data to the device
-    showErrors(
-        queue.enqueueWriteBuffer(left_in_buf, false, 0, size, left_in.data));
-    showErrors(
-        queue.enqueueWriteBuffer(right_in_buf, false, 0, size, right_in.data));
-
-    // Do the actual encoding. Note that the number of work items must be a
-    // multiple of the work group size
-    const auto items =
-        ((size_t)std::ceil((float)width * height / work_group_size)) *
-        work_group_size;
-    showErrors(queue.enqueueNDRangeKernel(kernel, 0, items, work_group_size));
+    if (showErrors(queue.enqueueWriteBuffer(left_in_buf->buffer, false, 0,
+                                            size, left_in.data)) or
+        showErrors(queue.enqueueWriteBuffer(right_in_buf->buffer, false, 0,
+                                            size, right_in.data))) {
+      return EXIT_FAILURE;
+    }
+
+    if (features.local_memory) {
+      // One work group per row, which caches the row of each image. The left
+      // image is only needed when checking the right one.
+      const auto element_bytes = elementBytes(features.element_type);
+      const auto right_cache_bytes = element_bytes * width;
+      const auto left_cache_bytes =
+          features.both_sides ? right_cache_bytes : element_bytes;
+      if (left_cache_bytes + right_cache_bytes > local_mem_size) {
+        std::cerr << "The local memory caches need "
+                  << left_cache_bytes + right_cache_bytes
+                  << " bytes, but the device only has " << local_mem_size
+                  << ". Use a kernel without local memory for this width."
+                  << std::endl;
+        return EXIT_FAILURE;
+      }
+      if (showErrors(kernel.setArg(cache_arg, cl::Local(left_cache_bytes))) or
+          showErrors(
+              kernel.setArg(cache_arg + 1, cl::Local(right_cache_bytes)))) {
+        return EXIT_FAILURE;
+      }
+
+      // Work items beyond the number of vectors in a row would be idle
+      const auto vectors_per_row =
+          (width + features.vector_width - 1) / features.vector_width;
+      work_group_size = std::min<size_t>(work_group_size, vectors_per_row);
+      if (showErrors(queue.enqueueNDRangeKernel(
+              kernel, cl::NullRange, cl::NDRange(work_group_size, height),
+              cl::NDRange(work_group_size, 1), nullptr, &kernel_event))) {
+        return EXIT_FAILURE;
+      }
+    } else {
+      // Each work item handles vector_width pixels. Note that the number of
+      // work items must be a multiple of the work group size
+      const auto pixels_per_group = work_group_size * features.vector_width;
+      const auto items =
+          ((size_t)std::ceil((float)width * height / pixels_per_group)) *
+          work_group_size;
+      if (showErrors(queue.enqueueNDRangeKernel(
+              kernel, 0, items, work_group_size, nullptr, &kernel_event))) {
+        return EXIT_FAILURE;
+      }
+    }
 
     // Read data from the device.
-    // Note that the last read is blocking.
-    showErrors(
-        queue.enqueueReadBuffer(left_out_buf, false, 0, size, left_out.data));
-    showErrors(
-        queue.enqueueReadBuffer(right_out_buf, true, 0, size, right_out.data));
+    // If only the left image is checked, the right outputs are left untouched.
+    const auto residual_bytes = residualBytes(width, height);
+    std::vector<std::tuple<const cl::Buffer *, size_t, uchar *>> reads;
+    reads.emplace_back(&left_out_buf->buffer, size, left_out.data);
+    if (features.both_sides) {
+      reads.emplace_back(&right_out_buf->buffer, size, right_out.data);
+    }
+    if (not left_residual.empty()) {
+      reads.emplace_back(&left_residual_buf->buffer, residual_bytes,
+                         left_residual.data);
+    }
+    if (features.both_sides and not right_residual.empty()) {
+      reads.emplace_back(&right_residual_buf->buffer, residual_bytes,
+                         right_residual.data);
+    }
+    for (const auto &[buffer, bytes, data] : reads) {
+      if (showErrors(queue.enqueueReadBuffer(*buffer, false, 0, bytes, data))) {
+        return EXIT_FAILURE;
+      }
+    }
     return EXIT_SUCCESS;
   }
 
+  /* Wait for all of the enqueued checks to complete. Returns true if any of
+   * them failed, in which case their outputs are undefined. Tests override
+   * this to inject failures. */
+  virtual bool finish() { return showErrors(queue.finish()); }
+
+  /* The time that the device spent in the most recent kernel, excluding the
+   * transfers. The queue must have been created with
+   * CL_QUEUE_PROFILING_ENABLE, and the kernel must have completed. */
+  double kernelSeconds() const {
+    cl_ulong start = 0;
+    cl_ulong end = 0;
+    if (showErrors(kernel_event.getProfilingInfo(CL_PROFILING_COMMAND_START,
+                                                 &start)) or
+        showErrors(
+            kernel_event.getProfilingInfo(CL_PROFILING_COMMAND_END, &end))) {
+      return 0;
+    }
+    return ScopedTimer::seconds(end - start);
+  }
+
+  /* Run the check and also read back the residuals of the pixels. Either of
+   * the residual images may be empty, in which case it is not read. */
+  bool operator()(const cv::Mat &left_in, const cv::Mat &right_in,
+                  const cv::Mat &left_out, const cv::Mat &right_out,
+                  const cv::Mat &left_residual, const cv::Mat &right_residual,
+                  size_t work_group_size) {
+    const auto failed = enqueue(left_in, right_in, left_out, right_out,
+                                left_residual, right_residual, work_group_size);
+    return finish() or failed;
+  }
+
+  bool operator()(const cv::Mat &left_in, const cv::Mat &right_in,
+                  const cv::Mat &left_out, const cv::Mat &right_out,
+                  size_t work_group_size) {
+    return operator()(left_in, right_in, left_out, right_out, cv::Mat(),
+                      cv::Mat(), work_group_size);
+  }
+
+  // Use the largest work group size of the kernel for this resolution
   bool operator()(const cv::Mat &left_in, const cv::Mat &right_in,
                   const cv::Mat &left_out, const cv::Mat &right_out) {
+    if (not switchResolution(left_in.cols, left_in.rows)) return EXIT_FAILURE;
     return operator()(left_in, right_in, left_out, right_out,
                       max_work_group_size);
   }
 
   bool cpp(const cv::Mat &left_in, const cv::Mat &right_in,
-           const cv::Mat &left_out, const cv::Mat &right_out) {
+           const cv::Mat &left_out, const cv::Mat &right_out,
+           const cv::Mat &left_residual = cv::Mat(),
+           const cv::Mat &right_residual = cv::Mat()) {
     // Check all of the dimensions
     if (areIncompatible(left_in, "Left input", right_in, "right input") or
         areIncompatible(left_in, "Left input", left_out, "left output") or
-        areIncompatible(left_in, "Left input", right_out, "right output")) {
+        areIncompatible(left_in, "Left input", right_out, "right output") or
+        areIncompatibleResiduals(left_in, left_residual, right_residual)) {
       return EXIT_FAILURE;
     }
 
-    get_global_id.reset();
-    for (size_t i = 0; i < size; ++i) {
-      consistencyCheck(tolerance, width,
-                       reinterpret_cast<const short *const>(left_in.data),
-                       reinterpret_cast<const short *const>(right_in.data),
-                       reinterpret_cast<short *>(left_out.data),
-                       reinterpret_cast<short *>(right_out.data));
-    };
+    referenceConsistencyCheck(tolerance, features, left_in, right_in, left_out,
+                              right_out, left_residual, right_residual);
     return EXIT_SUCCESS;
   }
 };
\ No newline at end of file
@@ -0,0 +1,232 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <future>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+
+#include "batch_queue.hpp"
+#include "generate_consistency_check.hpp"
+#include "scoped_timer.hpp"
+
+struct CheckResult {
+  // Set if the check, or any other check in its batch, failed
+  bool failed = false;
+  cv::Mat left_out;
+  // Only set if the kernel features include both sides
+  cv::Mat right_out;
+  // Only set if the kernel features include residuals
+  cv::Mat left_residual;
+  // Only set if the kernel features include both sides and residuals
+  cv::Mat right_residual;
+  // The time between submitting the request and a worker picking it up
+  double queueing_latency = 0;
+};
+
+/* Serves consistency checks submitted concurrently by any number of threads.
+ *
+ * Requests go through a lock-free queue to a set of worker threads. Each
+ * worker owns a ConsistencyCheck with its own kernel and command queue, and
+ * the workers are spread round-robin over the devices of the runtime. A worker
+ * takes up to max_batch_size requests at a time, enqueues all of them and
+ * waits for its queue only once, so that the transfers and kernels of a batch
+ * run back to back. */
+class Dispatcher {
+ public:
+  struct Metrics {
+    size_t requests = 0;
+    size_t batches = 0;
+    double mean_queueing_latency = 0;
+    double max_queueing_latency = 0;
+  };
+
+ private:
+  struct Request {
+    cv::Mat left_in;
+    cv::Mat right_in;
+    std::promise<CheckResult> promise;
+    ScopedTimer::Clock::time_point submitted;
+  };
+
+  BatchQueue<std::unique_ptr<Request>> requests;
+  size_t max_batch_size;
+  std::vector<std::unique_ptr<ConsistencyCheck>> checks;
+  std::vector<std::thread> workers;
+  // Only used to put idle workers to sleep. Submitting only takes it when a
+  // worker is asleep.
+  std::mutex mutex;
+  std::condition_variable wakeup;
+  std::atomic<size_t> sleeping_workers{0};
+  std::atomic<bool> stopping{false};
+
+  std::atomic<size_t> completed_requests{0};
+  std::atomic<size_t> completed_batches{0};
+  std::atomic<int64_t> total_latency{0};
+  std::atomic<int64_t> max_latency{0};
+
+  void recordLatency(int64_t latency) {
+    total_latency += latency;
+    auto max = max_latency.load();
+    while (latency > max and
+           not max_latency.compare_exchange_weak(max, latency)) {
+    }
+  }
+
+  void serve(ConsistencyCheck &check) {
+    const auto &features = check.getFeatures();
+    while (true) {
+      auto batch = requests.popBatch(max_batch_size);
+      if (batch.empty()) {
+        std::unique_lock<std::mutex> lock(mutex);
+        ++sleeping_workers;
+        // Pairs with the fence in submit(), so that either the worker sees
+        // the request or the producer sees the sleeping worker
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        wakeup.wait(lock,
+                    [this]() { return stopping or not requests.empty(); });
+        --sleeping_workers;
+        if (stopping and requests.empty()) return;
+        continue;
+      }
+
+      const auto now = ScopedTimer::Clock::now();
+      std::vector<CheckResult> results(batch.size());
+      for (size_t i = 0; i < batch.size(); ++i) {
+        const auto &request = *batch[i];
+        auto &result = results[i];
+        const auto latency = std::chrono::duration_cast<ScopedTimer::Units>(
+                                 now - request.submitted)
+                                 .count();
+        recordLatency(latency);
+        result.queueing_latency = ScopedTimer::seconds(latency);
+
+        const auto rows = request.left_in.rows;
+        const auto cols = request.left_in.cols;
+        const auto type = request.left_in.type();
+        result.left_out = cv::Mat(rows, cols, type);
+        if (features.both_sides) result.right_out = cv::Mat(rows, cols, type);
+        if (features.residuals) {
+          result.left_residual = cv::Mat(rows, cols, CV_8U);
+          if (features.both_sides) {
+            result.right_residual = cv::Mat(rows, cols, CV_8U);
+          }
+        }
+        // The maximum work group size depends on the kernel, which may change
+        // with the resolution. Switching waits for the checks enqueued so far,
+        // and their outputs are undefined if any of them failed.
+        auto pending_failed = false;
+        const auto switched =
+            check.switchResolution(cols, rows, &pending_failed);
+        if (pending_failed) {
+          for (size_t j = 0; j < i; ++j) results[j].failed = true;
+        }
+        if (not switched) {
+          result.failed = true;
+          continue;
+        }
+        result.failed =
+            check.enqueue(request.left_in, request.right_in, result.left_out,
+                          result.right_out, result.left_residual,
+                          result.right_residual, check.getMaxWorkGroupSize());
+      }
+      // The outputs of the whole batch are undefined if any command failed
+      if (check.finish()) {
+        for (auto &result : results) result.failed = true;
+      }
+
+      for (size_t i = 0; i < batch.size(); ++i) {
+        batch[i]->promise.set_value(std::move(results[i]));
+      }
+      completed_requests += batch.size();
+      ++completed_batches;
+    }
+  }
+
+ public:
+  Dispatcher(std::vector<std::unique_ptr<ConsistencyCheck>> checks,
+             size_t queue_capacity, size_t max_batch_size)
+      : requests(queue_capacity),
+        max_batch_size(std::max<size_t>(1, max_batch_size)),
+        checks(std::move(checks)) {
+    for (auto &check : this->checks) {
+      workers.emplace_back([this, &check]() { serve(*check); });
+    }
+  }
+
+  Dispatcher(const Dispatcher &) = delete;
+  Dispatcher &operator=(const Dispatcher &) = delete;
+
+  // Serve the requests which are still queued, then stop the workers
+  ~Dispatcher() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    wakeup.notify_all();
+    for (auto &worker : workers) worker.join();
+  }
+
+  size_t getWorkers() const { return workers.size(); }
+
+  /* Queue a check of the images. They are not copied, so they must not be
+   * modified until the result is ready. If the queue is full, this yields
+   * until a worker has made space. */
+  std::future<CheckResult> submit(const cv::Mat &left_in,
+                                  const cv::Mat &right_in) {
+    auto request = std::make_unique<Request>();
+    request->left_in = left_in;
+    request->right_in = right_in;
+    auto future = request->promise.get_future();
+    request->submitted = ScopedTimer::Clock::now();
+    while (not requests.tryPush(request)) std::this_thread::yield();
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (sleeping_workers.load(std::memory_order_relaxed) > 0) {
+      // Taking the lock makes sure that a worker which is about to sleep sees
+      // the request
+      { std::lock_guard<std::mutex> lock(mutex); }
+      wakeup.notify_one();
+    }
+    return future;
+  }
+
+  Metrics metrics() const {
+    Metrics metrics;
+    metrics.requests = completed_requests;
+    metrics.batches = completed_batches;
+    if (metrics.requests > 0) {
+      metrics.mean_queueing_latency =
+          ScopedTimer::seconds(total_latency.load()) / metrics.requests;
+    }
+    metrics.max_queueing_latency = ScopedTimer::seconds(max_latency.load());
+    return metrics;
+  }
+};
+
+/* Create a dispatcher with workers_per_device workers on each device of the
+ * runtime. Returns nullptr if any of their kernels can not be created. */
+static std::unique_ptr<Dispatcher> generateDispatcher(
+    Runtime &runtime, const KernelFeatures &features, uint16_t width = 0,
+    uint16_t height = 0, uint16_t tolerance = 0, bool using_macros = false,
+    size_t workers_per_device = 2, size_t max_batch_size = 4,
+    size_t queue_capacity = 256) {
+  std::vector<std::unique_ptr<ConsistencyCheck>> checks;
+  const auto devices = runtime.getDevices().size();
+  for (size_t i = 0; i < workers_per_device * devices; ++i) {
+    const auto device_index = i % devices;
+    const auto queue = runtime.createQueue(device_index);
+    auto check =
+        generateConsistencyCheck(runtime, features, width, height, tolerance,
+                                 using_macros, device_index, &queue);
+    if (not check) return nullptr;
+    checks.push_back(std::move(check));
+  }
+  return std::make_unique<Dispatcher>(std::move(checks), queue_capacity,
+                                      max_batch_size);
+}
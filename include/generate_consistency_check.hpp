@@ -1,70 +1,65 @@
 #pragma once
 
 #include "consistency_check.hpp"
+#include "runtime.hpp"
 
-static auto defaultMacros() {
-  return "-DINVALID_DISPARITY_VALUE=" + std::to_string(INVALID_DISPARITY_VALUE);
-}
-
-static auto allMacros(uint16_t width, uint16_t height, uint16_t tolerance) {
-  return defaultMacros()                          //
-         + " -DTOL=" + std::to_string(tolerance)  //
-         + " -DWIDTH=" + std::to_string(width)    //
-         + " -DELEMS=" + std::to_string(width * height);
+/* Start building the program that generateConsistencyCheck will need with the
+ * same arguments. Call this for all of the kernels up front so that they are
+ * compiled in parallel. */
+static auto prefetchConsistencyCheck(Runtime &runtime,
+                                     const KernelFeatures &features,
+                                     uint16_t width = 0, uint16_t tolerance = 0,
+                                     bool using_macros = false) {
+  return runtime.build(features, buildOptions(width, tolerance, using_macros));
 }
 
+/* Create a consistency check on the specified device of the runtime. This
+ * only builds the program if no other instance has requested it yet. Unless
+ * another queue is given, the check uses the queue of the device which is
+ * shared by all instances. Returns nullptr on failure. */
 static std::unique_ptr<ConsistencyCheck> generateConsistencyCheck(
-    const cl::Context &context, const cl::Device &device, const char *filename,
-    const char *kernelname, uint16_t width = 0, uint16_t height = 0,
-    uint16_t tolerance = 0, bool using_macros = false) {
-  const auto options =
-      using_macros ? allMacros(width, height, tolerance) : defaultMacros();
-  const auto program = buildProgramFromFile(context, device, filename, options);
-  if (not program) {
-    std::cerr << "Could not generate the program" << std::endl;
-    return nullptr;
-  }
-
-  // Build the kernel from the program
-  cl_int error = CL_SUCCESS;
-  cl::Kernel kernel(*program, kernelname, &error);
-  if (error != CL_SUCCESS) {
-    std::cerr << "Error creating the kernel '" << kernelname
-              << "' from the file " << filename
-              << "\nCheck that you have not misspelled the name of the "
-                 "kernel in that file."
-              << std::endl;
-    return nullptr;
-  }
+    Runtime &runtime, const KernelFeatures &features, uint16_t width = 0,
+    uint16_t height = 0, uint16_t tolerance = 0, bool using_macros = false,
+    size_t device_index = 0, const cl::CommandQueue *queue = nullptr) {
+  auto kernel = runtime.createKernel(
+      features, buildOptions(width, tolerance, using_macros));
+  if (not kernel) return nullptr;
+  const auto &device = runtime.getDevices().at(device_index);
   static constexpr auto verbose = false;
-  if (verbose) printDetails(device, kernel, kernelname, filename);
-  return std::make_unique<ConsistencyCheck>(context, device, kernel, width,
-                                            height, tolerance, using_macros);
+  if (verbose) {
+    printDetails(device, *kernel, "consistencyCheck", features.name().c_str());
+  }
+  auto consistency_check = std::make_unique<ConsistencyCheck>(
+      runtime, device_index, queue ? *queue : runtime.getQueue(device_index),
+      *kernel, width, height, tolerance, features, using_macros);
+  if (not consistency_check->resize(width, height)) return nullptr;
+  return consistency_check;
 }
 
-static std::unique_ptr<ConsistencyCheck> generateConsistencyCheck(
-    const char *filename, const char *kernelname, uint16_t width = 0,
-    uint16_t height = 0, uint16_t tolerance = 0, bool using_macros = false,
-    cl_device_type device_type = CL_DEVICE_TYPE_GPU) {
-  // Get a list of devices of the specified type
-  cl::Context context(device_type);
-  const auto devices = context.getInfo<CL_CONTEXT_DEVICES>();
-  if (devices.empty()) {
-    std::cerr << "There are no devices of type "
-              << deviceTypeToString(device_type) << " in this context";
-    return nullptr;
+/* Create a runtime holding all of the devices of each platform. If a platform
+ * name is given, only the platforms whose name contains it are used. */
+static std::vector<std::unique_ptr<Runtime>> generateRuntimes(
+    cl_device_type device_type = CL_DEVICE_TYPE_ALL,
+    const std::string &platform_name = "") {
+  std::vector<std::unique_ptr<Runtime>> runtimes;
+  std::vector<cl::Platform> platforms;
+  cl::Platform::get(&platforms);
+  for (const auto &platform : platforms) {
+    if (platform.getInfo<CL_PLATFORM_NAME>().find(platform_name) ==
+        std::string::npos) {
+      continue;
+    }
+    std::vector<cl::Device> devices;
+    platform.getDevices(device_type, &devices);
+    if (not devices.empty()) {
+      runtimes.push_back(std::make_unique<Runtime>(cl::Context(devices)));
+    }
   }
-  if (devices.size() > 1) {
-    std::cerr << "There are more than one device in this context. You may "
-                 "want to consider specifying the device manually. We are "
-                 "using the first entry."
-              << std::endl;
+  if (runtimes.empty()) {
+    std::cerr << "There are no devices of type "
+              << deviceTypeToString(device_type)
+              << (platform_name.empty() ? "" : " on the platform ")
+              << platform_name << std::endl;
   }
-
-  // Use the first device to generate the kernel
-  cl::Device device(devices[0]);
-  static constexpr auto verbose = false;
-  if (verbose) printDetails(device);
-  return generateConsistencyCheck(context, device, filename, kernelname, width,
-                                  height, tolerance, using_macros);
+  return runtimes;
 }
@@ -0,0 +1,498 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "invalid_point.hpp"
+
+// The residual written for pixels without a match in the row
+static constexpr int MAX_RESIDUAL = 255;
+
+// How the validity of a pixel is turned into the output value.
+// Branch uses if-statements that short-circuit as soon as a check fails.
+// Select evaluates every check (clamping the lookup into the row) and then
+// picks the output with a ternary, so the kernel contains no divergent code.
+enum class Branching { Branch, Select };
+
+// The element type of the disparity images as seen by the kernel
+enum class ElementType { Short, UShort };
+
+inline auto elementTypeToString(ElementType type) {
+  switch (type) {
+    case ElementType::Short:
+      return "short";
+    case ElementType::UShort:
+      return "ushort";
+  }
+  return "";
+}
+
+inline size_t elementBytes(ElementType type) {
+  switch (type) {
+    case ElementType::Short:
+      return sizeof(int16_t);
+    case ElementType::UShort:
+      return sizeof(uint16_t);
+  }
+  return 0;
+}
+
+/* The set of features from which a consistency check kernel is generated.
+ * Every combination yields a valid kernel named "consistencyCheck" with the
+ * signature
+ *
+ *   [int TOL, int WIDTH,]  // only if they are not macros
+ *   int ELEMS,
+ *   left_in, right_in, left_out, right_out,
+ *   [__global uchar* left_residual, __global uchar* right_residual]
+ *   [__local left_cache, __local right_cache]  // only with local_memory
+ *
+ * Without local memory, the kernel is launched as a 1D range over the pixels.
+ * With local memory, it is launched as a 2D range with one work group per row
+ * (global size {group size, rows}, local size {group size, 1}), and each cache
+ * holds WIDTH elements.
+ */
+struct KernelFeatures {
+  Branching branching = Branching::Branch;
+  // If false, only the left image is checked and right_out is never written
+  bool both_sides = true;
+  ElementType element_type = ElementType::Short;
+  // Number of consecutive pixels handled by each work item (1, 2, 4, 8, 16)
+  uint8_t vector_width = 1;
+  // Check each row in one work group, which caches the row in local memory
+  bool local_memory = false;
+  // Accept a pixel if any pixel within TOL columns of the match maps back to
+  // within TOL columns of it, instead of only comparing the disparities
+  bool relaxed = false;
+  // Also write the residual of each pixel to a uchar image in the same pass.
+  // For the strict check, it is |d_L - d_R|. For the relaxed check, it is the
+  // smallest distance between the pixel and where a pixel in the window maps
+  // back to. It is clamped to MAX_RESIDUAL, which is also used when the match
+  // is not in the row or the disparity is invalid.
+  bool residuals = false;
+
+  std::string name() const {
+    return std::string(branching == Branching::Branch ? "branch" : "select") +
+           (both_sides ? "_both" : "_left") + "_" +
+           elementTypeToString(element_type) + "_v" +
+           std::to_string(vector_width) + (local_memory ? "_local" : "") +
+           (relaxed ? "_relaxed" : "") + (residuals ? "_residuals" : "");
+  }
+
+  bool isValid() const {
+    switch (vector_width) {
+      case 1:
+      case 2:
+      case 4:
+      case 8:
+      case 16:
+        return true;
+    }
+    return false;
+  }
+};
+
+inline auto defaultMacros() {
+  return "-DINVALID_DISPARITY_VALUE=" + std::to_string(INVALID_DISPARITY_VALUE);
+}
+
+// The number of elements remains a kernel argument, so that a program built
+// with macros can be used for any image height
+inline auto allMacros(uint16_t width, uint16_t tolerance) {
+  return defaultMacros()                          //
+         + " -DTOL=" + std::to_string(tolerance)  //
+         + " -DWIDTH=" + std::to_string(width);
+}
+
+inline auto buildOptions(uint16_t width, uint16_t tolerance,
+                         bool using_macros) {
+  return using_macros ? allMacros(width, tolerance) : defaultMacros();
+}
+
+// Enumerate the whole search space of kernels
+inline std::vector<KernelFeatures> allKernelFeatures() {
+  std::vector<KernelFeatures> all;
+  for (const auto branching : {Branching::Branch, Branching::Select}) {
+    for (const auto both_sides : {true, false}) {
+      for (const auto element_type :
+           {ElementType::Short, ElementType::UShort}) {
+        for (const uint8_t vector_width : {1, 2, 4, 8, 16}) {
+          for (const auto local_memory : {false, true}) {
+            for (const auto relaxed : {false, true}) {
+              for (const auto residuals : {false, true}) {
+                all.push_back({branching, both_sides, element_type,
+                               vector_width, local_memory, relaxed, residuals});
+              }
+            }
+          }
+        }
+      }
+    }
+  }
+  return all;
+}
+
+namespace kernel_generator_details {
+
+// The check of a single pixel against the other image. "side" is either
+// "Left" (look up the left disparity in the right image) or "Right". The
+// lookup is "other[row_offset + c]". With local memory, "other" is the cached
+// row and row_offset is 0.
+inline std::string checkFunction(const KernelFeatures &features,
+                                 const std::string &side) {
+  const std::string type = elementTypeToString(features.element_type);
+  const std::string space = features.local_memory ? "__local" : "__global";
+  const auto left = side == "Left";
+  // Column in the other image that this pixel claims to match
+  const std::string match = left ? "col + disp" : "col - disp";
+  // Column in this image that pixel c of the other image maps back to
+  const std::string back =
+      left ? "c - other[row_offset + c]" : "c + other[row_offset + c]";
+
+  const auto max_residual = std::to_string(MAX_RESIDUAL);
+  const auto branch = features.branching == Branching::Branch;
+  const std::string in_row =
+      "(disp != INVALID_DISPARITY_VALUE) & (match >= 0) & (match < width)";
+  const std::string out_of_row =
+      "disp == INVALID_DISPARITY_VALUE || match < 0 || match >= width";
+
+  std::string src;
+  src += "inline " + type + " check" + side +
+         "(int tol, int width, int col, int row_offset, int disp,\n";
+  src += "    " + space + " const " + type + "* other" +
+         (features.residuals ? ", uchar* residual" : "") + ") {\n";
+  src += "  const int match = " + match + ";\n";
+  if (features.residuals) {
+    // The distance has to be computed even when it is larger than the
+    // tolerance, so there are no early exits
+    if (branch) {
+      src += "  if (" + out_of_row + ") {\n";
+      src += "    *residual = " + max_residual + ";\n";
+      src += "    return INVALID_DISPARITY_VALUE;\n";
+      src += "  }\n";
+    }
+    if (features.relaxed) {
+      src += "  const int start = max(0, match - tol);\n";
+      src += "  const int stop = min(width - 1, match + tol);\n";
+      src += "  int distance = INT_MAX;\n";
+      src += "  for (int c = start; c <= stop; ++c) {\n";
+      src += "    distance = min(distance, (int)abs(" + back + " - col));\n";
+      src += "  }\n";
+    } else if (branch) {
+      src += "  const int distance =\n";
+      src += "      abs(disp - other[row_offset + match]);\n";
+    } else {
+      src += "  const int clamped = clamp(match, 0, width - 1);\n";
+      src += "  const int distance =\n";
+      src += "      abs(disp - other[row_offset + clamped]);\n";
+    }
+    if (branch) {
+      src += "  *residual = min(distance, " + max_residual + ");\n";
+      src += "  return distance <= tol ? disp : INVALID_DISPARITY_VALUE;\n";
+    } else {
+      src += "  const int in_row = " + in_row + ";\n";
+      src += "  *residual = in_row ? min(distance, " + max_residual +
+             ") : " + max_residual + ";\n";
+      src += "  const int valid = in_row & (distance <= tol);\n";
+      src += "  return valid ? disp : INVALID_DISPARITY_VALUE;\n";
+    }
+  } else if (features.relaxed) {
+    if (branch) {
+      src += "  if (" + out_of_row + ") {\n";
+      src += "    return INVALID_DISPARITY_VALUE;\n";
+      src += "  }\n";
+      src += "  const int start = max(0, match - tol);\n";
+      src += "  const int stop = min(width - 1, match + tol);\n";
+      src += "  for (int c = start; c <= stop; ++c) {\n";
+      src += "    if (abs(" + back + " - col) <= tol) return disp;\n";
+      src += "  }\n";
+      src += "  return INVALID_DISPARITY_VALUE;\n";
+    } else {
+      // The window is clamped into the row, so no lookup can leave it. An
+      // empty window (match outside of the row) simply finds nothing.
+      src += "  const int start = max(0, match - tol);\n";
+      src += "  const int stop = min(width - 1, match + tol);\n";
+      src += "  int found = 0;\n";
+      src += "  for (int c = start; c <= stop; ++c) {\n";
+      src += "    found |= abs(" + back + " - col) <= tol;\n";
+      src += "  }\n";
+      src += "  const int valid = found & " + in_row + ";\n";
+      src += "  return valid ? disp : INVALID_DISPARITY_VALUE;\n";
+    }
+  } else {
+    if (branch) {
+      src += "  if (disp != INVALID_DISPARITY_VALUE && match >= 0 &&\n";
+      src += "      match < width &&\n";
+      src += "      abs(disp - other[row_offset + match]) <= tol) {\n";
+      src += "    return disp;\n";
+      src += "  }\n";
+      src += "  return INVALID_DISPARITY_VALUE;\n";
+    } else {
+      src += "  const int clamped = clamp(match, 0, width - 1);\n";
+      src += "  const int distance =\n";
+      src += "      abs(disp - other[row_offset + clamped]);\n";
+      src += "  const int valid = " + in_row + " & (distance <= tol);\n";
+      src += "  return valid ? disp : INVALID_DISPARITY_VALUE;\n";
+    }
+  }
+  src += "}\n\n";
+  return src;
+}
+
+/* Check the pixel in column "col" and write the results to the destinations.
+ * The lookups in the other image are relative to row_offset. */
+inline std::string checkPixel(const KernelFeatures &features,
+                              const std::string &col,
+                              const std::string &row_offset,
+                              const std::string &left_in,
+                              const std::string &right_in,
+                              const std::string &left_dest,
+                              const std::string &right_dest,
+                              const std::string &left_residual_dest,
+                              const std::string &right_residual_dest) {
+  const std::string left_other =
+      features.local_memory ? "right_cache" : "right_in";
+  const std::string right_other =
+      features.local_memory ? "left_cache" : "left_in";
+  const std::string residual = features.residuals ? ", &residual" : "";
+  const std::string args = "(TOL, WIDTH, " + col + ", " + row_offset + ",\n";
+  std::string src;
+  src += "    {\n";
+  if (features.residuals) src += "      uchar residual;\n";
+  src += "      " + left_dest + " = checkLeft" + args;
+  src += "          " + left_in + ", " + left_other + residual + ");\n";
+  if (features.residuals) {
+    src += "      " + left_residual_dest + " = residual;\n";
+  }
+  if (features.both_sides) {
+    src += "      " + right_dest + " = checkRight" + args;
+    src += "          " + right_in + ", " + right_other + residual + ");\n";
+    if (features.residuals) {
+      src += "      " + right_residual_dest + " = residual;\n";
+    }
+  }
+  src += "    }\n";
+  return src;
+}
+
+// Check the pixel with the flat index "i" of the image in global memory
+inline std::string checkFlatPixel(const KernelFeatures &features,
+                                  const std::string &i,
+                                  const std::string &left_in,
+                                  const std::string &right_in,
+                                  const std::string &left_dest,
+                                  const std::string &right_dest,
+                                  const std::string &left_residual_dest,
+                                  const std::string &right_residual_dest) {
+  std::string src;
+  src += "    {\n";
+  src += "      const int col = (" + i + ") % WIDTH;\n";
+  src += "      const int row_offset = (" + i + ") - col;\n";
+  src += checkPixel(features, "col", "row_offset", left_in, right_in,
+                    left_dest, right_dest, left_residual_dest,
+                    right_residual_dest);
+  src += "    }\n";
+  return src;
+}
+
+/* The body of the kernel with local memory. Each work group checks one row,
+ * which it first copies to the caches. That way every pixel of both images is
+ * read from global memory exactly once, no matter how far the disparities
+ * reach. The work items then walk along the row in steps of whole vectors. */
+inline std::string rowKernelBody(const KernelFeatures &features) {
+  const std::string type = elementTypeToString(features.element_type);
+  const auto vec = std::to_string(features.vector_width);
+  const auto vec_type = features.vector_width == 1 ? type : type + vec;
+  // The right check reads the left row anyway, so the own disparities come
+  // from the caches
+  const std::string left_row =
+      features.both_sides ? "left_cache" : "(left_in + row_start)";
+
+  std::string src;
+  src += "  const int row_start = get_group_id(1) * WIDTH;\n";
+  src += "  for (int c = get_local_id(0); c < WIDTH;\n";
+  src += "       c += get_local_size(0)) {\n";
+  src += "    right_cache[c] = right_in[row_start + c];\n";
+  if (features.both_sides) {
+    src += "    left_cache[c] = left_in[row_start + c];\n";
+  }
+  src += "  }\n";
+  src += "  barrier(CLK_LOCAL_MEM_FENCE);\n";
+  src += "  __global " + type +
+         "* const left_row_out = left_out + row_start;\n";
+  if (features.both_sides) {
+    src += "  __global " + type +
+           "* const right_row_out = right_out + row_start;\n";
+  }
+  if (features.residuals) {
+    src += "  __global uchar* const left_row_residual =\n";
+    src += "      left_residual + row_start;\n";
+    if (features.both_sides) {
+      src += "  __global uchar* const right_row_residual =\n";
+      src += "      right_residual + row_start;\n";
+    }
+  }
+  src += "  for (int col = get_local_id(0) * " + vec + "; col < WIDTH;\n";
+  src += "       col += get_local_size(0) * " + vec + ") {\n";
+
+  const auto tail = [&](const std::string &c) {
+    return checkPixel(features, c, "0", left_row + "[" + c + "]",
+                      "right_cache[" + c + "]", "left_row_out[" + c + "]",
+                      "right_row_out[" + c + "]",
+                      "left_row_residual[" + c + "]",
+                      "right_row_residual[" + c + "]");
+  };
+  if (features.vector_width == 1) {
+    src += tail("col");
+    src += "  }\n";
+    return src;
+  }
+
+  static constexpr auto lanes = "0123456789abcdef";
+  const auto load = " = vload" + vec + "(0, ";
+  const auto store = "    vstore" + vec + "(";
+  src += "  if (col + " + vec + " <= WIDTH) {\n";
+  src += "    const " + vec_type + " left_in_disp" + load + left_row +
+         " + col);\n";
+  if (features.both_sides) {
+    src += "    const " + vec_type + " right_in_disp" + load +
+           "right_cache + col);\n";
+  }
+  src += "    " + vec_type + " left_out_disp;\n";
+  if (features.both_sides) src += "    " + vec_type + " right_out_disp;\n";
+  if (features.residuals) {
+    src += "    uchar" + vec + " left_residuals;\n";
+    if (features.both_sides) src += "    uchar" + vec + " right_residuals;\n";
+  }
+  for (size_t lane = 0; lane < features.vector_width; ++lane) {
+    const auto s = std::string(".s") + lanes[lane];
+    src += checkPixel(features, "col + " + std::to_string(lane), "0",
+                      "left_in_disp" + s, "right_in_disp" + s,
+                      "left_out_disp" + s, "right_out_disp" + s,
+                      "left_residuals" + s, "right_residuals" + s);
+  }
+  src += store + "left_out_disp, 0, left_row_out + col);\n";
+  if (features.both_sides) {
+    src += store + "right_out_disp, 0, right_row_out + col);\n";
+  }
+  if (features.residuals) {
+    src += store + "left_residuals, 0, left_row_residual + col);\n";
+    if (features.both_sides) {
+      src += store + "right_residuals, 0, right_row_residual + col);\n";
+    }
+  }
+  src += "  } else {\n";
+  // The end of the row which does not fill a whole vector
+  src += "    for (int c = col; c < WIDTH; ++c) {\n";
+  src += tail("c");
+  src += "    }\n";
+  src += "  }\n";
+  src += "  }\n";
+  return src;
+}
+
+/* The body of the kernel without local memory. Each work item checks
+ * vector_width consecutive pixels of the flattened images. */
+inline std::string flatKernelBody(const KernelFeatures &features) {
+  const std::string type = elementTypeToString(features.element_type);
+  const auto vec = std::to_string(features.vector_width);
+  const auto vec_type = features.vector_width == 1 ? type : type + vec;
+
+  std::string src;
+  src += "  const int first = get_global_id(0) * " + vec + ";\n";
+  // The number of work items is rounded up to a multiple of the work group
+  // size, so the trailing items must not touch memory
+  src += "  if (first >= ELEMS) return;\n";
+
+  if (features.vector_width == 1) {
+    src += "  " + type + " left_out_disp;\n";
+    if (features.both_sides) src += "  " + type + " right_out_disp;\n";
+    src += checkFlatPixel(features, "first", "left_in[first]",
+                          "right_in[first]", "left_out_disp", "right_out_disp",
+                          "left_residual[first]", "right_residual[first]");
+    src += "  left_out[first] = left_out_disp;\n";
+    if (features.both_sides) src += "  right_out[first] = right_out_disp;\n";
+  } else {
+    static constexpr auto lanes = "0123456789abcdef";
+    const auto load = " = vload" + vec + "(0, ";
+    const auto store = "  vstore" + vec + "(";
+    src += "  if (first + " + vec + " <= ELEMS) {\n";
+    src += "    const " + vec_type + " left_in_disp" + load +
+           "left_in + first);\n";
+    src += "    const " + vec_type + " right_in_disp" + load +
+           "right_in + first);\n";
+    src += "    " + vec_type + " left_out_disp;\n";
+    src += "    " + vec_type + " right_out_disp;\n";
+    if (features.residuals) {
+      src += "    uchar" + vec + " left_residuals;\n";
+      src += "    uchar" + vec + " right_residuals;\n";
+    }
+    for (size_t lane = 0; lane < features.vector_width; ++lane) {
+      const auto s = std::string(".s") + lanes[lane];
+      src += checkFlatPixel(features, "first + " + std::to_string(lane),
+                            "left_in_disp" + s, "right_in_disp" + s,
+                            "left_out_disp" + s, "right_out_disp" + s,
+                            "left_residuals" + s, "right_residuals" + s);
+    }
+    src += "  " + store + "left_out_disp, 0, left_out + first);\n";
+    if (features.both_sides) {
+      src += "  " + store + "right_out_disp, 0, right_out + first);\n";
+    }
+    if (features.residuals) {
+      src += "  " + store + "left_residuals, 0, left_residual + first);\n";
+      if (features.both_sides) {
+        src += "  " + store + "right_residuals, 0, right_residual + first);\n";
+      }
+    }
+    src += "  } else {\n";
+    // The tail of the image which does not fill a whole vector
+    src += "    for (int i = first; i < ELEMS; ++i) {\n";
+    src += checkFlatPixel(features, "i", "left_in[i]", "right_in[i]",
+                          "left_out[i]", "right_out[i]", "left_residual[i]",
+                          "right_residual[i]");
+    src += "    }\n";
+    src += "  }\n";
+  }
+  return src;
+}
+
+}  // namespace kernel_generator_details
+
+/* Generate the OpenCL source of the consistency check kernel with the
+ * specified features. INVALID_DISPARITY_VALUE must be passed as a macro when
+ * building the program. TOL and WIDTH may optionally be passed as macros
+ * (see buildOptions), in which case they are removed from the kernel
+ * arguments. ELEMS is always an argument, so that one program serves every
+ * height. */
+inline std::string generateKernelSource(const KernelFeatures &features) {
+  using namespace kernel_generator_details;
+  const std::string type = elementTypeToString(features.element_type);
+
+  std::string src;
+  src += "// Generated consistency check: " + features.name() + "\n\n";
+  src += checkFunction(features, "Left");
+  if (features.both_sides) src += checkFunction(features, "Right");
+
+  src += "__kernel void consistencyCheck(\n";
+  src += "#ifndef TOL\n    int TOL,\n#endif\n";
+  src += "#ifndef WIDTH\n    int WIDTH,\n#endif\n";
+  src += "    int ELEMS,\n";
+  src += "    __global const " + type + "* const left_in,\n";
+  src += "    __global const " + type + "* const right_in,\n";
+  src += "    __global " + type + "* left_out, __global " + type +
+         "* right_out";
+  if (features.residuals) {
+    src += ",\n    __global uchar* left_residual,";
+    src += " __global uchar* right_residual";
+  }
+  if (features.local_memory) {
+    src += ",\n    __local " + type + "* left_cache, __local " + type +
+           "* right_cache";
+  }
+  src += ") {\n";
+  src += features.local_memory ? rowKernelBody(features)
+                               : flatKernelBody(features);
+  src += "}\n";
+  return src;
+}
@@ -2,12 +2,39 @@
 
 #include <opencv2/opencv.hpp>
 
-inline auto randomDisparityImage(size_t rows, size_t cols) {
+inline auto randomDisparityImage(size_t rows, size_t cols,
+                                 double max_disparity = std::pow(2, 12)) {
   cv::Mat mat(rows, cols, CV_16UC1);
-  cv::randu(mat, cv::Scalar(0), cv::Scalar(std::pow(2, 12)));
+  cv::randu(mat, cv::Scalar(0), cv::Scalar(max_disparity));
   return mat;
 }
 
 inline auto solidImage(size_t rows, size_t cols, uint16_t val) {
   return cv::Mat(rows, cols, CV_16UC1, cv::Scalar(val));
-}
\ No newline at end of file
+}
+
+// Alternating squares of the value and 0 (an invalid disparity)
+inline auto checkerboardImage(size_t rows, size_t cols, size_t square,
+                              uint16_t val) {
+  cv::Mat mat(rows, cols, CV_16UC1);
+  for (size_t i = 0; i < rows; ++i) {
+    for (size_t j = 0; j < cols; ++j) {
+      mat.at<uint16_t>(i, j) = ((i / square + j / square) % 2) ? val : 0;
+    }
+  }
+  return mat;
+}
+
+// Disparities whose matches land exactly on the edge of the row, or one pixel
+// past it. For the left image, the match is on the last column; for the right
+// image, it is on the first column.
+inline auto edgeOfRowImage(size_t rows, size_t cols, bool left) {
+  cv::Mat mat(rows, cols, CV_16UC1);
+  for (size_t i = 0; i < rows; ++i) {
+    for (size_t j = 0; j < cols; ++j) {
+      const auto past_edge = (i + j) % 2;
+      mat.at<uint16_t>(i, j) = left ? cols - 1 - j + past_edge : j + past_edge;
+    }
+  }
+  return mat;
+}
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdlib>
+#include <limits>
+
+#include <opencv2/opencv.hpp>
+
+#include "invalid_point.hpp"
+#include "kernel_generator.hpp"
+
+/* A plain scalar implementation of the consistency check which is trusted to
+ * be correct. It has exactly the semantics of the generated kernels, so their
+ * outputs can be compared pixel by pixel.
+ *
+ * Left pixel (row, col) with disparity d is consistent if the right pixel
+ * (row, col + d) is inside the row and
+ *   strict:  its disparity is within tol of d, or
+ *   relaxed: any right pixel c within tol columns of it maps back (c - R[c])
+ *            to within tol columns of col.
+ * The right image is checked symmetrically with col - d and c + L[c].
+ *
+ * If the residual images are given, they receive the distance which was
+ * compared against tol (the smallest one in the relaxed case), clamped to
+ * MAX_RESIDUAL. */
+template <typename T>
+void referenceConsistencyCheck(int tol, int width, int elems,
+                               const T *const left_in, const T *const right_in,
+                               T *left_out, T *right_out, bool relaxed,
+                               bool both_sides = true,
+                               uint8_t *left_residual = nullptr,
+                               uint8_t *right_residual = nullptr) {
+  const auto check = [&](int col, int row_offset, int disp, const T *other,
+                         int direction, uint8_t *residual) -> T {
+    const int match = col + direction * disp;
+    if (disp == INVALID_DISPARITY_VALUE or match < 0 or match >= width) {
+      if (residual) *residual = MAX_RESIDUAL;
+      return INVALID_DISPARITY_VALUE;
+    }
+    int distance = std::numeric_limits<int>::max();
+    if (relaxed) {
+      const int start = std::max(0, match - tol);
+      const int stop = std::min(width - 1, match + tol);
+      for (int c = start; c <= stop; ++c) {
+        distance = std::min(
+            distance, std::abs(c - direction * other[row_offset + c] - col));
+      }
+    } else {
+      distance = std::abs(disp - other[row_offset + match]);
+    }
+    if (residual) *residual = std::min(distance, MAX_RESIDUAL);
+    return distance <= tol ? disp : INVALID_DISPARITY_VALUE;
+  };
+
+  for (int i = 0; i < elems; ++i) {
+    const int col = i % width;
+    const int row_offset = i - col;
+    left_out[i] = check(col, row_offset, left_in[i], right_in, 1,
+                        left_residual ? left_residual + i : nullptr);
+    if (both_sides) {
+      right_out[i] = check(col, row_offset, right_in[i], left_in, -1,
+                           right_residual ? right_residual + i : nullptr);
+    }
+  }
+}
+
+/* Run the reference on 16-bit images, interpreting the pixels as the element
+ * type of the specified kernel features. The residual images are optional
+ * 8-bit images. */
+inline void referenceConsistencyCheck(
+    int tol, const KernelFeatures &features, const cv::Mat &left_in,
+    const cv::Mat &right_in, const cv::Mat &left_out, const cv::Mat &right_out,
+    const cv::Mat &left_residual = cv::Mat(),
+    const cv::Mat &right_residual = cv::Mat()) {
+  const auto width = left_in.cols;
+  const auto elems = left_in.rows * left_in.cols;
+  const auto left_res = left_residual.empty() ? nullptr : left_residual.data;
+  const auto right_res = right_residual.empty() ? nullptr : right_residual.data;
+  if (features.element_type == ElementType::Short) {
+    referenceConsistencyCheck(
+        tol, width, elems, reinterpret_cast<const int16_t *>(left_in.data),
+        reinterpret_cast<const int16_t *>(right_in.data),
+        reinterpret_cast<int16_t *>(left_out.data),
+        reinterpret_cast<int16_t *>(right_out.data), features.relaxed,
+        features.both_sides, left_res, right_res);
+  } else {
+    referenceConsistencyCheck(
+        tol, width, elems, reinterpret_cast<const uint16_t *>(left_in.data),
+        reinterpret_cast<const uint16_t *>(right_in.data),
+        reinterpret_cast<uint16_t *>(left_out.data),
+        reinterpret_cast<uint16_t *>(right_out.data), features.relaxed,
+        features.both_sides, left_res, right_res);
+  }
+}
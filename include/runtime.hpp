@@ -0,0 +1,233 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <CL/cl.hpp>
+
+#include "buffer_pool.hpp"
+#include "cl_details.hpp"
+#include "kernel_generator.hpp"
+#include "scoped_timer.hpp"
+
+/* One context with its devices, a command queue per device, a pool of device
+ * buffers and a registry of the generated programs, shared by any number of
+ * ConsistencyCheck instances.
+ *
+ * Each (features, build options) pair is compiled once for all devices.
+ * Builds are queued as soon as they are requested, and started by at most
+ * one thread per hardware thread, so several of them run in parallel without
+ * oversubscribing the machine. Completion is reported through the OpenCL
+ * build callback rather than by polling. */
+class Runtime {
+ public:
+  using ProgramPtr = std::shared_ptr<const cl::Program>;
+
+ private:
+  struct Build {
+    std::string name;
+    std::string options;
+    cl::Program program;
+    std::vector<cl::Device> devices;
+    std::promise<ProgramPtr> promise;
+    std::once_flag done;
+    // Set by the build callback before it publishes the result
+    std::atomic<bool> notified{false};
+    ScopedTimer::Clock::time_point start = ScopedTimer::Clock::now();
+
+    // Publish the result. Called exactly once, either from the build callback
+    // or when clBuildProgram fails without invoking it.
+    void finish() {
+      std::call_once(done, [this]() {
+        const auto elapsed = ScopedTimer::seconds(
+            std::chrono::duration_cast<ScopedTimer::Units>(
+                ScopedTimer::Clock::now() - start)
+                .count());
+        for (const auto &device : devices) {
+          if (program.getBuildInfo<CL_PROGRAM_BUILD_STATUS>(device) !=
+              CL_BUILD_SUCCESS) {
+            const auto device_name = device.getInfo<CL_DEVICE_NAME>();
+            const auto log = program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(device);
+            std::cerr << "Error building " << name << "\nBuild log for "
+                      << device_name << ":\n"
+                      << log << std::endl;
+            promise.set_value(nullptr);
+            return;
+          }
+        }
+        std::cout << "Built " << name << " in " << elapsed << " seconds"
+                  << std::endl;
+        promise.set_value(std::make_shared<const cl::Program>(program));
+      });
+    }
+
+    /* The callback owns a reference to the build, which it only drops once
+     * finish() has returned. The runtime may be destroyed as soon as the
+     * result is published, while the callback is still returning. */
+    static void CL_CALLBACK onBuilt(cl_program, void *data) {
+      std::unique_ptr<std::shared_ptr<Build>> owner(
+          static_cast<std::shared_ptr<Build> *>(data));
+      (*owner)->notified = true;
+      (*owner)->finish();
+    }
+  };
+
+  cl::Context context;
+  std::vector<cl::Device> devices;
+  std::vector<cl::CommandQueue> queues;
+  std::shared_ptr<BufferPool> buffer_pool;
+  std::mutex mutex;
+  std::map<std::string, std::shared_ptr<Build>> builds;
+  std::map<std::string, std::shared_future<ProgramPtr>> programs;
+  // Builds which have not been started yet, and the threads which start
+  // them. Some drivers only return from clBuildProgram once the build is
+  // complete, even when given a callback, so the number of threads bounds
+  // the number of concurrent builds.
+  std::deque<std::shared_ptr<Build>> pending;
+  std::vector<std::thread> builders;
+  std::condition_variable pending_changed;
+  bool stopping = false;
+
+  static size_t maxBuilders() {
+    return std::max(1u, std::thread::hardware_concurrency());
+  }
+
+  void startPendingBuilds() {
+    while (true) {
+      std::shared_ptr<Build> build;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        pending_changed.wait(
+            lock, [this]() { return stopping or not pending.empty(); });
+        if (pending.empty()) return;
+        build = pending.front();
+        pending.pop_front();
+      }
+      build->start = ScopedTimer::Clock::now();
+      auto *owner = new std::shared_ptr<Build>(build);
+      if (build->program.build(build->devices, build->options.c_str(),
+                               Build::onBuilt, owner) != CL_SUCCESS) {
+        build->finish();
+        // Unless the callback has already run, the build failed before it
+        // started, and the callback will never release its reference
+        if (not build->notified) delete owner;
+      }
+    }
+  }
+
+ public:
+  explicit Runtime(const cl::Context &context)
+      : context(context),
+        devices(context.getInfo<CL_CONTEXT_DEVICES>()),
+        buffer_pool(std::make_shared<BufferPool>(context)) {
+    for (const auto &device : devices) {
+      queues.emplace_back(context, device);
+    }
+  }
+
+  Runtime(const Runtime &) = delete;
+  Runtime &operator=(const Runtime &) = delete;
+
+  // Wait for all of the outstanding builds. The callbacks keep their builds
+  // alive until they return, so they may outlive this object.
+  ~Runtime() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    pending_changed.notify_all();
+    for (auto &builder : builders) builder.join();
+    for (auto &[name, build] : builds) programs.at(name).wait();
+  }
+
+  const cl::Context &getContext() const { return context; }
+  const std::vector<cl::Device> &getDevices() const { return devices; }
+  const cl::CommandQueue &getQueue(size_t device_index) const {
+    return queues.at(device_index);
+  }
+  BufferPool &getBufferPool() const { return *buffer_pool; }
+
+  // Create an additional queue, e.g. to submit work from another thread or
+  // to enable profiling
+  cl::CommandQueue createQueue(
+      size_t device_index, cl_command_queue_properties properties = 0) const {
+    return cl::CommandQueue(context, devices.at(device_index), properties);
+  }
+
+  static auto key(const KernelFeatures &features, const std::string &options) {
+    return features.name() + " " + options;
+  }
+
+  size_t size() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return programs.size();
+  }
+
+  /* Start building the program for the specified features, unless it has
+   * already been requested. This returns immediately. The future holds
+   * nullptr if the program could not be built. */
+  std::shared_future<ProgramPtr> build(const KernelFeatures &features,
+                                       const std::string &options) {
+    const auto name = key(features, options);
+    std::lock_guard<std::mutex> lock(mutex);
+    const auto it = programs.find(name);
+    if (it != programs.end()) return it->second;
+
+    auto build = std::make_shared<Build>();
+    build->name = name;
+    build->options = options;
+    build->devices = devices;
+    auto future = build->promise.get_future().share();
+    programs.emplace(name, future);
+    if (not features.isValid()) {
+      std::cerr << "Invalid kernel features " << features.name() << std::endl;
+      build->promise.set_value(nullptr);
+      return future;
+    }
+
+    build->program = cl::Program(context, generateKernelSource(features));
+    pending.push_back(build);
+    builds.emplace(name, std::move(build));
+    if (builders.size() < maxBuilders()) {
+      builders.emplace_back([this]() { startPendingBuilds(); });
+    }
+    pending_changed.notify_one();
+    return future;
+  }
+
+  // Get the program for the specified features, waiting for it to be built
+  ProgramPtr get(const KernelFeatures &features, const std::string &options) {
+    return build(features, options).get();
+  }
+
+  /* Create the consistency check kernel for the specified features, waiting
+   * for its program to be built. Returns nullptr on failure. */
+  std::unique_ptr<cl::Kernel> createKernel(const KernelFeatures &features,
+                                           const std::string &options) {
+    const auto program = get(features, options);
+    if (not program) {
+      std::cerr << "Could not generate the program" << std::endl;
+      return nullptr;
+    }
+    static constexpr auto kernelname = "consistencyCheck";
+    cl_int error = CL_SUCCESS;
+    auto kernel = std::make_unique<cl::Kernel>(*program, kernelname, &error);
+    if (error != CL_SUCCESS) {
+      std::cerr << "Error creating the kernel '" << kernelname
+                << "' for the features " << features.name() << ": "
+                << errorString(error) << std::endl;
+      return nullptr;
+    }
+    return kernel;
+  }
+};
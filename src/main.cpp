@@ -1,8 +1,14 @@
+#include <atomic>
+#include <cstdlib>
+#include <future>
 #include <iostream>
+#include <thread>
+#include <vector>
 
 #include <opencv2/opencv.hpp>
 
 #include "average_time.hpp"
+#include "dispatcher.hpp"
 #include "filesystem.hpp"
 #include "generate_consistency_check.hpp"
 #include "random_disparity_image.hpp"
@@ -11,7 +17,8 @@
 enum class ImageType { Random, Solid, File };
 
 int main() {
-  static constexpr auto show_images = true;
+  // Only show the images if there is a display to show them on
+  const auto show_images = std::getenv("DISPLAY") != nullptr;
   auto image_type = ImageType::Solid;
   const auto here = fs::absolute(__FILE__).parent_path();
 
@@ -66,27 +73,99 @@ int main() {
     right_in.colRange(cols / 2, cols) = cols / 2;
   }
 
-  // Time several consistency check kernels
-  for (const auto &with_macros : {false, true}) {
-    for (const auto &file :
-         {"consistency_check.cl", "consistency_check_ternary.cl"}) {
-      // Create the kernel
-      const auto tolerance = 500 / scale;
-      const auto opencl_file = here / "../cl" / file;
-      auto consistency_check_ptr = generateConsistencyCheck(
-          opencl_file.c_str(), "consistencyCheck", left_in.cols, left_in.rows,
-          tolerance, with_macros);
-      if (not consistency_check_ptr) {
-        return EXIT_FAILURE;
+  // The kernels are validated against the scalar reference by the tests
+  auto runtimes = generateRuntimes();
+  if (runtimes.empty()) {
+    return EXIT_FAILURE;
+  }
+
+  // Time several of the generated consistency check kernels. Programs are
+  // compiled once per runtime and shared, so the whole search space of
+  // allKernelFeatures() can be enumerated in the same way.
+  const auto tolerance = 500 / scale;
+  std::vector<KernelFeatures> kernels;
+  for (const auto &branching : {Branching::Branch, Branching::Select}) {
+    for (const uint8_t vector_width : {1, 4}) {
+      for (const auto &local_memory : {false, true}) {
+        KernelFeatures features;
+        features.branching = branching;
+        features.vector_width = vector_width;
+        features.local_memory = local_memory;
+        kernels.push_back(features);
+      }
+    }
+  }
+  for (auto &runtime : runtimes) {
+    for (const auto &with_macros : {false, true}) {
+      for (const auto &features : kernels) {
+        prefetchConsistencyCheck(*runtime, features, cols, tolerance,
+                                 with_macros);
       }
-      auto consistency_check = *consistency_check_ptr;
+    }
+    const auto &devices = runtime->getDevices();
+    for (size_t device_index = 0; device_index < devices.size();
+         ++device_index) {
+      const auto device_name = devices[device_index].getInfo<CL_DEVICE_NAME>();
+      for (const auto &with_macros : {false, true}) {
+        for (const auto &features : kernels) {
+          // Create the kernel
+          auto consistency_check_ptr = generateConsistencyCheck(
+              *runtime, features, cols, rows, tolerance, with_macros,
+              device_index);
+          if (not consistency_check_ptr) {
+            return EXIT_FAILURE;
+          }
+          auto consistency_check = *consistency_check_ptr;
 
-      const auto average_time = averageTime(
-          [&]() { consistency_check(left_in, right_in, left_out, right_out); });
-      std::cout << file << (with_macros ? " with " : " without ")
-                << "macros took on average " << average_time << " seconds"
-                << std::endl;
+          const auto average_time = averageTime([&]() {
+            consistency_check(left_in, right_in, left_out, right_out);
+          });
+          const auto name = device_name + " " + features.name() +
+                            (with_macros ? " with" : " without") + " macros";
+          std::cout << name << " took on average " << average_time
+                    << " seconds" << std::endl;
+        }
+      }
+    }
+  }
+
+  // Serve checks requested concurrently by several threads
+  for (auto &runtime : runtimes) {
+    auto dispatcher =
+        generateDispatcher(*runtime, kernels.front(), cols, rows, tolerance);
+    if (not dispatcher) {
+      return EXIT_FAILURE;
+    }
+    static constexpr auto producers = 4;
+    static constexpr auto requests_per_producer = 25;
+    std::atomic<bool> failed{false};
+    double elapsed;
+    {
+      ScopedTimer timer(&elapsed);
+      std::vector<std::thread> threads;
+      for (auto i = 0; i < producers; ++i) {
+        threads.emplace_back([&]() {
+          std::vector<std::future<CheckResult>> results;
+          for (auto j = 0; j < requests_per_producer; ++j) {
+            results.push_back(dispatcher->submit(left_in, right_in));
+          }
+          for (auto &result : results) {
+            if (result.get().failed) failed = true;
+          }
+        });
+      }
+      for (auto &thread : threads) thread.join();
+    }
+    if (failed) {
+      return EXIT_FAILURE;
     }
+    const auto metrics = dispatcher->metrics();
+    std::cout << "The dispatcher served " << metrics.requests
+              << " requests in " << metrics.batches << " batches with "
+              << dispatcher->getWorkers() << " workers in " << elapsed
+              << " seconds. Queueing latency: mean "
+              << metrics.mean_queueing_latency << ", max "
+              << metrics.max_queueing_latency << " seconds" << std::endl;
   }
 
   // Show the images
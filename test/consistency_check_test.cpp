@@ -0,0 +1,239 @@
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+
+#include "filesystem.hpp"
+#include "generate_consistency_check.hpp"
+#include "random_disparity_image.hpp"
+#include "timing_baseline.hpp"
+#include "validate_consistency_check.hpp"
+#include "validate_dispatcher.hpp"
+
+// Tells ctest that the test was skipped (see SKIP_RETURN_CODE)
+static constexpr int EXIT_SKIPPED = 77;
+
+static void printUsage(const char *name) {
+  std::cerr
+      << "Usage: " << name
+      << " [--device-type all|cpu|gpu] [--platform <name>]\n"
+         "       [--timing --baseline <file> [--update-baseline]]"
+         " [--max-slowdown <factor>]\n\n"
+         "Validates every kernel variant against the scalar reference on\n"
+         "every device, or with --timing, compares the kernel times against\n"
+         "the baseline. Only the platforms whose name contains <name> are\n"
+         "used. With --update-baseline, the baseline entries of the devices\n"
+         "are replaced by the measured times instead."
+      << std::endl;
+}
+
+/* Cycle a check through several resolutions, and make sure that the buffer
+ * pool stops allocating once it holds buffers for the largest one. Also make
+ * sure that the residual buffers are not allocated at the size of the
+ * outputs, which have the same flags. Returns true on failure. */
+static bool validateBufferPool(Runtime &runtime) {
+  auto &pool = runtime.getBufferPool();
+  static constexpr size_t residual_bytes = 4096;
+  const auto output = pool.acquire(CL_MEM_WRITE_ONLY, 2 * residual_bytes);
+  const auto residual = pool.acquire(CL_MEM_WRITE_ONLY, residual_bytes);
+  if (not output or not residual) return EXIT_FAILURE;
+  if (residual->capacity >= output->capacity) {
+    std::cerr << "The buffer pool handed out " << residual->capacity
+              << " bytes for a residual buffer of " << residual_bytes
+              << " bytes" << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  static constexpr auto cycles = 3;
+  const std::vector<std::pair<int, int>> resolutions = {
+      {37, 101}, {19, 51}, {64, 200}, {37, 101}};
+  KernelFeatures features;
+  features.residuals = true;
+  auto consistency_check = generateConsistencyCheck(runtime, features);
+  if (not consistency_check) return EXIT_FAILURE;
+
+  size_t allocations = 0;
+  for (auto cycle = 0; cycle < cycles; ++cycle) {
+    for (const auto &[rows, cols] : resolutions) {
+      const auto left_in = randomDisparityImage(rows, cols, cols / 2);
+      const auto right_in = randomDisparityImage(rows, cols, cols / 2);
+      cv::Mat left_out(rows, cols, left_in.type());
+      cv::Mat right_out(rows, cols, left_in.type());
+      cv::Mat left_residual(rows, cols, CV_8UC1);
+      cv::Mat right_residual(rows, cols, CV_8UC1);
+      if ((*consistency_check)(left_in, right_in, left_out, right_out,
+                               left_residual, right_residual,
+                               consistency_check->getMaxWorkGroupSize())) {
+        return EXIT_FAILURE;
+      }
+    }
+    const auto new_allocations = runtime.getBufferPool().getAllocations();
+    if (cycle > 0 and new_allocations != allocations) {
+      std::cerr << "The buffer pool allocated " << new_allocations - allocations
+                << " buffers in cycle " << cycle
+                << " through resolutions that it has already seen"
+                << std::endl;
+      return EXIT_FAILURE;
+    }
+    allocations = new_allocations;
+  }
+  return false;
+}
+
+/* Time several kernels on every device, and compare them against the
+ * baseline. The kernel time is read from profiling events, so that the
+ * transfers do not add noise. Devices without a baseline are skipped. */
+static int timeKernels(std::vector<std::unique_ptr<Runtime>> &runtimes,
+                       const fs::path &baseline_path, bool update_baseline,
+                       double max_slowdown) {
+  static constexpr auto rows = 512;
+  static constexpr auto cols = 1024;
+  static constexpr auto tolerance = 2;
+  const auto left_in = randomDisparityImage(rows, cols, 64);
+  const auto right_in = randomDisparityImage(rows, cols, 64);
+  cv::Mat left_out(rows, cols, left_in.type());
+  cv::Mat right_out(rows, cols, left_in.type());
+
+  std::vector<KernelFeatures> kernels;
+  for (const auto &branching : {Branching::Branch, Branching::Select}) {
+    for (const uint8_t vector_width : {1, 4}) {
+      for (const auto &local_memory : {false, true}) {
+        KernelFeatures features;
+        features.branching = branching;
+        features.vector_width = vector_width;
+        features.local_memory = local_memory;
+        kernels.push_back(features);
+      }
+    }
+  }
+
+  auto baseline = readTimingBaseline(baseline_path);
+  size_t compared = 0;
+  auto regressed = false;
+  for (auto &runtime : runtimes) {
+    for (const auto &with_macros : {false, true}) {
+      for (const auto &features : kernels) {
+        prefetchConsistencyCheck(*runtime, features, cols, tolerance,
+                                 with_macros);
+      }
+    }
+    const auto &devices = runtime->getDevices();
+    for (size_t device_index = 0; device_index < devices.size();
+         ++device_index) {
+      const auto device_name = devices[device_index].getInfo<CL_DEVICE_NAME>();
+      const auto queue =
+          runtime->createQueue(device_index, CL_QUEUE_PROFILING_ENABLE);
+      for (const auto &with_macros : {false, true}) {
+        for (const auto &features : kernels) {
+          auto consistency_check =
+              generateConsistencyCheck(*runtime, features, cols, rows,
+                                       tolerance, with_macros, device_index,
+                                       &queue);
+          if (not consistency_check) return EXIT_FAILURE;
+
+          auto failed = false;
+          const auto seconds = medianTime([&]() {
+            failed |= (*consistency_check)(left_in, right_in, left_out,
+                                           right_out);
+            return consistency_check->kernelSeconds();
+          });
+          if (failed) return EXIT_FAILURE;
+          const auto name = device_name + " " + features.name() +
+                            (with_macros ? " with" : " without") + " macros";
+          std::cout << name << " took " << seconds << " seconds" << std::endl;
+          if (update_baseline) {
+            baseline[name] = seconds;
+          } else if (baseline.count(name)) {
+            regressed |= isRegression(baseline, name, seconds, max_slowdown);
+            ++compared;
+          } else {
+            std::cout << "There is no baseline for " << name << std::endl;
+          }
+        }
+      }
+    }
+  }
+
+  if (update_baseline) {
+    return writeTimingBaseline(baseline_path, baseline) ? EXIT_SUCCESS
+                                                        : EXIT_FAILURE;
+  }
+  if (regressed) return EXIT_FAILURE;
+  if (compared == 0) {
+    std::cout << "None of the devices have a baseline in " << baseline_path
+              << ". Build the update_timing_baseline target to record one."
+              << std::endl;
+    return EXIT_SKIPPED;
+  }
+  return EXIT_SUCCESS;
+}
+
+int main(int argc, char **argv) {
+  cl_device_type device_type = CL_DEVICE_TYPE_ALL;
+  std::string platform_name;
+  auto timing = false;
+  auto update_baseline = false;
+  fs::path baseline_path;
+  // Kernel times of small images still vary by some 10 % between runs
+  auto max_slowdown = 1.5;
+  for (int i = 1; i < argc; ++i) {
+    const auto has_value = i + 1 < argc;
+    if (not std::strcmp(argv[i], "--device-type") and has_value) {
+      const std::string type = argv[++i];
+      if (type == "cpu") {
+        device_type = CL_DEVICE_TYPE_CPU;
+      } else if (type == "gpu") {
+        device_type = CL_DEVICE_TYPE_GPU;
+      } else if (type != "all") {
+        printUsage(argv[0]);
+        return EXIT_FAILURE;
+      }
+    } else if (not std::strcmp(argv[i], "--platform") and has_value) {
+      platform_name = argv[++i];
+    } else if (not std::strcmp(argv[i], "--timing")) {
+      timing = true;
+    } else if (not std::strcmp(argv[i], "--baseline") and has_value) {
+      baseline_path = argv[++i];
+    } else if (not std::strcmp(argv[i], "--update-baseline")) {
+      update_baseline = true;
+    } else if (not std::strcmp(argv[i], "--max-slowdown") and has_value) {
+      max_slowdown = std::atof(argv[++i]);
+    } else {
+      printUsage(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+  if (timing and baseline_path.empty()) {
+    printUsage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  auto runtimes = generateRuntimes(device_type, platform_name);
+  if (runtimes.empty()) {
+    // Only a missing platform which was asked for by name is not an error
+    return platform_name.empty() ? EXIT_FAILURE : EXIT_SKIPPED;
+  }
+
+  if (timing) {
+    return timeKernels(runtimes, baseline_path, update_baseline,
+                       max_slowdown);
+  }
+  auto failed = false;
+  if (validateAllKernels(runtimes)) {
+    std::cerr << "Some kernels do not match the reference" << std::endl;
+    failed = true;
+  }
+  for (auto &runtime : runtimes) {
+    failed |= validateBufferPool(*runtime);
+    if (validateDispatchers(*runtime) or validateBatchFailure(*runtime)) {
+      std::cerr << "Some dispatched checks do not match the reference"
+                << std::endl;
+      failed = true;
+    }
+  }
+  failed |= stressBatchQueue();
+  return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
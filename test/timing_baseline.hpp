@@ -0,0 +1,78 @@
+#pragma once
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "filesystem.hpp"
+
+/* Kernel run times (in seconds) of named benchmarks, measured on the device
+ * with profiling events so that they exclude the transfers. The names start
+ * with the device name, so one file holds the baselines of several devices.
+ *
+ * The file stores one benchmark per line as "<seconds> <name>", so that names
+ * may contain spaces. Lines starting with '#' are comments. */
+using TimingBaseline = std::map<std::string, double>;
+
+inline TimingBaseline readTimingBaseline(const fs::path &path) {
+  TimingBaseline baseline;
+  std::ifstream file(path);
+  std::string line;
+  while (std::getline(file, line)) {
+    if (line.empty() or line.front() == '#') continue;
+    std::istringstream stream(line);
+    double seconds;
+    std::string name;
+    if (stream >> seconds and std::getline(stream >> std::ws, name)) {
+      baseline[name] = seconds;
+    }
+  }
+  return baseline;
+}
+
+inline bool writeTimingBaseline(const fs::path &path,
+                                const TimingBaseline &baseline) {
+  std::ofstream file(path);
+  if (not file) {
+    std::cerr << "Could not write the timing baseline " << path << std::endl;
+    return false;
+  }
+  file << "# Median kernel times in seconds. Regenerate the entries of the\n"
+          "# devices in this machine with the update_timing_baseline target.\n";
+  for (const auto &[name, seconds] : baseline) {
+    file << seconds << " " << name << "\n";
+  }
+  return true;
+}
+
+/* Compare the time of a benchmark against its baseline, which must exist.
+ * Returns true if it is more than max_slowdown times slower. */
+inline bool isRegression(const TimingBaseline &baseline,
+                         const std::string &name, double seconds,
+                         double max_slowdown) {
+  const auto expected = baseline.at(name);
+  if (seconds > max_slowdown * expected) {
+    std::cerr << name << " regressed from " << expected << " to " << seconds
+              << " seconds" << std::endl;
+    return true;
+  }
+  return false;
+}
+
+// The median is not thrown off by the occasional preempted run
+template <typename Func>
+double medianTime(const Func &func, size_t iterations = 51,
+                  size_t skip_iterations = 2) {
+  std::vector<double> times;
+  for (size_t i = 0; i < iterations; ++i) {
+    const auto time = func();
+    if (i >= skip_iterations) times.push_back(time);
+  }
+  std::nth_element(times.begin(), times.begin() + times.size() / 2,
+                   times.end());
+  return times[times.size() / 2];
+}
@@ -0,0 +1,190 @@
+#pragma once
+
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+
+#include "generate_consistency_check.hpp"
+#include "random_disparity_image.hpp"
+#include "reference_consistency_check.hpp"
+
+struct ValidationInput {
+  std::string name;
+  cv::Mat left;
+  cv::Mat right;
+};
+
+/* Inputs which exercise the corner cases of the kernels. The width should not
+ * be a multiple of the vector widths or work group sizes, so that rows start
+ * in the middle of vectors and groups, and the images have a ragged tail.
+ *
+ * The last two inputs have values of at least 0x8000, which are negative
+ * disparities for the short kernels, so they tell the element types apart. */
+inline auto validationInputs(size_t rows, size_t cols) {
+  std::vector<ValidationInput> inputs;
+  inputs.push_back({"random", randomDisparityImage(rows, cols, cols / 2),
+                    randomDisparityImage(rows, cols, cols / 2)});
+  inputs.push_back(
+      {"solid", solidImage(rows, cols, 5), solidImage(rows, cols, 5)});
+  inputs.push_back({"checkerboard", checkerboardImage(rows, cols, 4, 3),
+                    checkerboardImage(rows, cols, 3, 3)});
+  inputs.push_back({"edge of row", edgeOfRowImage(rows, cols, true),
+                    edgeOfRowImage(rows, cols, false)});
+  inputs.push_back({"full range",
+                    randomDisparityImage(rows, cols, 0x10000),
+                    randomDisparityImage(rows, cols, 0x10000)});
+  // Small disparities stored as -1 - d, i.e. 0xFFFF - d
+  const cv::Mat max_value = solidImage(rows, cols, 0xFFFF);
+  inputs.push_back({"negative", max_value - randomDisparityImage(rows, cols, 8),
+                    max_value - randomDisparityImage(rows, cols, 8)});
+  return inputs;
+}
+
+inline size_t countMismatches(const cv::Mat &expected, const cv::Mat &actual) {
+  return cv::countNonZero(expected != actual);
+}
+
+/* Compare the kernel with the specified features against the scalar
+ * reference on every input and tolerance, with each of the work group sizes.
+ * Returns the number of failed comparisons. */
+inline size_t validateConsistencyCheck(
+    Runtime &runtime, const KernelFeatures &features,
+    const std::vector<ValidationInput> &inputs,
+    const std::vector<uint16_t> &tolerances,
+    const std::vector<size_t> &work_group_sizes, bool using_macros,
+    size_t device_index) {
+  const auto &first = inputs.front().left;
+  auto consistency_check_ptr = generateConsistencyCheck(
+      runtime, features, first.cols, first.rows, tolerances.front(),
+      using_macros, device_index);
+  if (not consistency_check_ptr) return inputs.size() * tolerances.size();
+  auto &consistency_check = *consistency_check_ptr;
+
+  size_t failures = 0;
+  for (const auto &input : inputs) {
+    const auto rows = input.left.rows;
+    const auto cols = input.left.cols;
+    const auto type = input.left.type();
+    for (const auto tolerance : tolerances) {
+      if (not consistency_check.resize(cols, rows) or
+          not consistency_check.setTolerance(tolerance)) {
+        ++failures;
+        continue;
+      }
+      cv::Mat expected_left(rows, cols, type, cv::Scalar(0));
+      cv::Mat expected_right(rows, cols, type, cv::Scalar(0));
+      cv::Mat expected_left_residual, expected_right_residual;
+      if (features.residuals) {
+        expected_left_residual = cv::Mat(rows, cols, CV_8UC1, cv::Scalar(0));
+        expected_right_residual = cv::Mat(rows, cols, CV_8UC1, cv::Scalar(0));
+      }
+      referenceConsistencyCheck(tolerance, features, input.left, input.right,
+                                expected_left, expected_right,
+                                expected_left_residual,
+                                expected_right_residual);
+
+      for (auto work_group_size : work_group_sizes) {
+        work_group_size = std::min(work_group_size,
+                                   consistency_check.getMaxWorkGroupSize());
+
+        // Fill the outputs with garbage so that pixels which are never
+        // written show up as mismatches
+        static constexpr cl_ushort garbage = 0xBEEF;
+        cv::Mat left_out(rows, cols, type, cv::Scalar(garbage));
+        cv::Mat right_out(rows, cols, type, cv::Scalar(garbage));
+        cv::Mat left_residual, right_residual;
+        if (features.residuals) {
+          const auto residual_garbage = cv::Scalar(garbage & 0xFF);
+          left_residual = cv::Mat(rows, cols, CV_8UC1, residual_garbage);
+          right_residual = cv::Mat(rows, cols, CV_8UC1, residual_garbage);
+        }
+        consistency_check.fillOutputs(garbage);
+        if (consistency_check(input.left, input.right, left_out, right_out,
+                              left_residual, right_residual,
+                              work_group_size)) {
+          ++failures;
+          continue;
+        }
+
+        auto left_mismatches = countMismatches(expected_left, left_out);
+        auto right_mismatches =
+            features.both_sides ? countMismatches(expected_right, right_out)
+                                : 0;
+        if (features.residuals) {
+          left_mismatches +=
+              countMismatches(expected_left_residual, left_residual);
+          if (features.both_sides) {
+            right_mismatches +=
+                countMismatches(expected_right_residual, right_residual);
+          }
+        }
+        if (left_mismatches or right_mismatches) {
+          std::cerr << features.name() << (using_macros ? " with" : " without")
+                    << " macros failed on the " << rows << "x" << cols << " "
+                    << input.name << " input with tolerance " << tolerance
+                    << " and work group size " << work_group_size << ": "
+                    << left_mismatches << " left and " << right_mismatches
+                    << " right pixels differ from the reference" << std::endl;
+          ++failures;
+        }
+      }
+    }
+  }
+  return failures;
+}
+
+/* Validate every kernel variant, with and without macros, on every device.
+ * Each instance is also run on a smaller resolution afterwards, so that
+ * switching resolutions is covered. A tolerance of 0 only accepts exact
+ * matches, and a large one makes the relaxed windows reach past the ends of
+ * the rows. The odd work group size makes groups straddle rows, and makes the
+ * local memory kernels take several steps along each row. Returns the number
+ * of failed comparisons. */
+inline size_t validateAllKernels(
+    std::vector<std::unique_ptr<Runtime>> &runtimes, size_t rows = 37,
+    size_t cols = 101, const std::vector<uint16_t> &tolerances = {2, 0, 9},
+    const std::vector<size_t> &work_group_sizes = {64, 7}) {
+  auto inputs = validationInputs(rows, cols);
+  const auto smaller_cols = cols / 2 + 1;
+  for (auto &input : validationInputs(rows / 2 + 1, smaller_cols)) {
+    inputs.push_back(std::move(input));
+  }
+  const auto all_features = allKernelFeatures();
+
+  // Build all of the programs in parallel
+  for (auto &runtime : runtimes) {
+    for (const auto &features : all_features) {
+      prefetchConsistencyCheck(*runtime, features);
+      for (const auto &width : {cols, smaller_cols}) {
+        for (const auto &tolerance : tolerances) {
+          prefetchConsistencyCheck(*runtime, features, width, tolerance, true);
+        }
+      }
+    }
+  }
+
+  size_t failures = 0;
+  for (auto &runtime : runtimes) {
+    const auto &devices = runtime->getDevices();
+    for (size_t device_index = 0; device_index < devices.size();
+         ++device_index) {
+      const auto device_name = devices[device_index].getInfo<CL_DEVICE_NAME>();
+      size_t device_failures = 0;
+      for (const auto &features : all_features) {
+        for (const auto &with_macros : {false, true}) {
+          device_failures += validateConsistencyCheck(
+              *runtime, features, inputs, tolerances, work_group_sizes,
+              with_macros, device_index);
+        }
+      }
+      std::cout << "Validated " << all_features.size() << " kernels on "
+                << device_name << ": " << device_failures << " failures"
+                << std::endl;
+      failures += device_failures;
+    }
+  }
+  return failures;
+}
@@ -0,0 +1,251 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <future>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+
+#include "batch_queue.hpp"
+#include "dispatcher.hpp"
+#include "reference_consistency_check.hpp"
+#include "validate_consistency_check.hpp"
+
+/* Push distinct values from several producers while several consumers pop
+ * them in batches. Every value must come out exactly once, and each consumer
+ * must see the values of each producer in the order that they were pushed.
+ * Returns true on failure. */
+inline bool stressBatchQueue(size_t producers = 4, size_t consumers = 4,
+                             size_t values_per_producer = 100000,
+                             size_t capacity = 64, size_t max_batch_size = 8) {
+  BatchQueue<size_t> queue(capacity);
+  const auto values = producers * values_per_producer;
+  std::atomic<size_t> popped{0};
+  std::vector<std::vector<size_t>> received(consumers);
+  std::vector<std::thread> threads;
+  for (size_t producer = 0; producer < producers; ++producer) {
+    threads.emplace_back([&, producer]() {
+      for (size_t i = 0; i < values_per_producer; ++i) {
+        auto value = producer * values_per_producer + i;
+        while (not queue.tryPush(value)) std::this_thread::yield();
+      }
+    });
+  }
+  for (size_t consumer = 0; consumer < consumers; ++consumer) {
+    threads.emplace_back([&, consumer]() {
+      auto &values_received = received[consumer];
+      while (popped < values) {
+        const auto batch = queue.popBatch(max_batch_size);
+        if (batch.empty()) std::this_thread::yield();
+        values_received.insert(values_received.end(), batch.begin(),
+                               batch.end());
+        popped += batch.size();
+      }
+    });
+  }
+  for (auto &thread : threads) thread.join();
+
+  std::vector<size_t> times_received(values, 0);
+  for (const auto &values_received : received) {
+    std::vector<size_t> next(producers, 0);
+    for (const auto value : values_received) {
+      const auto producer = value / values_per_producer;
+      if (value < next[producer]) {
+        std::cerr << "The batch queue reordered the values of producer "
+                  << producer << std::endl;
+        return EXIT_FAILURE;
+      }
+      next[producer] = value + 1;
+      ++times_received[value];
+    }
+  }
+  const auto lost_or_duplicated =
+      values - static_cast<size_t>(std::count(times_received.begin(),
+                                              times_received.end(), 1));
+  if (lost_or_duplicated or not queue.empty()) {
+    std::cerr << "The batch queue lost or duplicated " << lost_or_duplicated
+              << " of " << values << " values" << std::endl;
+    return EXIT_FAILURE;
+  }
+  return false;
+}
+
+/* Submit checks of two resolutions from several threads at once, and compare
+ * each result against the scalar reference. With macros, each worker switches
+ * kernels along with the resolution. Returns the number of failed checks. */
+inline size_t validateDispatcher(Runtime &runtime,
+                                 const KernelFeatures &features,
+                                 bool using_macros, uint16_t tolerance = 2,
+                                 size_t producers = 4) {
+  static constexpr auto rows = 37;
+  static constexpr auto cols = 101;
+  auto inputs = validationInputs(rows, cols);
+  for (auto &input : validationInputs(rows / 2 + 1, cols / 2 + 1)) {
+    inputs.push_back(std::move(input));
+  }
+
+  std::vector<CheckResult> expected(inputs.size());
+  for (size_t i = 0; i < inputs.size(); ++i) {
+    const auto &input = inputs[i];
+    const auto size = input.left.size();
+    const auto type = input.left.type();
+    auto &result = expected[i];
+    result.left_out = cv::Mat(size, type, cv::Scalar(0));
+    result.right_out = cv::Mat(size, type, cv::Scalar(0));
+    if (features.residuals) {
+      result.left_residual = cv::Mat(size, CV_8UC1, cv::Scalar(0));
+      result.right_residual = cv::Mat(size, CV_8UC1, cv::Scalar(0));
+    }
+    referenceConsistencyCheck(tolerance, features, input.left, input.right,
+                              result.left_out, result.right_out,
+                              result.left_residual, result.right_residual);
+  }
+
+  auto dispatcher = generateDispatcher(runtime, features, cols, rows,
+                                       tolerance, using_macros);
+  if (not dispatcher) return inputs.size() * producers;
+
+  const auto differs = [](const cv::Mat &expected, const cv::Mat &actual) {
+    return actual.size() != expected.size() or
+           countMismatches(expected, actual) != 0;
+  };
+  std::atomic<size_t> failures{0};
+  std::vector<std::thread> threads;
+  for (size_t producer = 0; producer < producers; ++producer) {
+    threads.emplace_back([&, producer]() {
+      // Start each producer at another input, so that the resolutions of
+      // consecutive requests are mixed
+      std::vector<std::pair<size_t, std::future<CheckResult>>> futures;
+      for (size_t j = 0; j < inputs.size(); ++j) {
+        const auto i = (producer + j) % inputs.size();
+        futures.emplace_back(
+            i, dispatcher->submit(inputs[i].left, inputs[i].right));
+      }
+      for (auto &[i, future] : futures) {
+        const auto result = future.get();
+        auto failed = result.failed or
+                      differs(expected[i].left_out, result.left_out);
+        if (features.both_sides) {
+          failed |= differs(expected[i].right_out, result.right_out);
+        } else {
+          failed |= not result.right_out.empty();
+        }
+        if (features.residuals) {
+          failed |= differs(expected[i].left_residual, result.left_residual);
+          if (features.both_sides) {
+            failed |=
+                differs(expected[i].right_residual, result.right_residual);
+          }
+        }
+        if (not features.both_sides or not features.residuals) {
+          failed |= not result.right_residual.empty();
+        }
+        if (failed) {
+          std::cerr << "The dispatcher of " << features.name()
+                    << (using_macros ? " with" : " without")
+                    << " macros failed on the " << inputs[i].left.rows << "x"
+                    << inputs[i].left.cols << " " << inputs[i].name << " input"
+                    << std::endl;
+          ++failures;
+        }
+      }
+    });
+  }
+  for (auto &thread : threads) thread.join();
+  return failures;
+}
+
+/* A check whose finish() fails on the specified call, as if a command on the
+ * device had failed. The first call blocks until it is released, so that the
+ * requests submitted meanwhile are served as one batch. */
+class FaultyConsistencyCheck : public ConsistencyCheck {
+ private:
+  size_t finishes = 0;
+  size_t failing_finish;
+  std::shared_future<void> released;
+
+ public:
+  std::promise<void> blocked;
+
+  FaultyConsistencyCheck(Runtime &runtime, cl::Kernel &kernel, uint16_t width,
+                         uint16_t height, uint16_t tolerance,
+                         const KernelFeatures &features,
+                         size_t failing_finish,
+                         std::shared_future<void> released)
+      : ConsistencyCheck(runtime, 0, runtime.createQueue(0), kernel, width,
+                         height, tolerance, features, false),
+        failing_finish(failing_finish),
+        released(std::move(released)) {}
+
+  bool finish() override {
+    if (++finishes == 1) {
+      blocked.set_value();
+      released.wait();
+    }
+    return ConsistencyCheck::finish() or finishes == failing_finish;
+  }
+};
+
+/* Serve a batch whose second request switches resolutions, and make the wait
+ * for the first request fail. The first request must be reported as failed,
+ * even though the rest of the batch succeeds. Returns true on failure. */
+inline bool validateBatchFailure(Runtime &runtime, uint16_t tolerance = 2) {
+  static constexpr auto rows = 37;
+  static constexpr auto cols = 101;
+  KernelFeatures features;
+  const auto kernel =
+      runtime.createKernel(features, buildOptions(cols, tolerance, false));
+  if (not kernel) return EXIT_FAILURE;
+  // The first finish() ends the batch of the first request, and the second
+  // one waits for the first request of the next batch when it switches
+  std::promise<void> release;
+  auto check = std::make_unique<FaultyConsistencyCheck>(
+      runtime, *kernel, cols, rows, tolerance, features, 2,
+      release.get_future().share());
+  if (not check->resize(cols, rows)) return EXIT_FAILURE;
+  auto blocked = check->blocked.get_future();
+  std::vector<std::unique_ptr<ConsistencyCheck>> checks;
+  checks.push_back(std::move(check));
+  Dispatcher dispatcher(std::move(checks), 16, 8);
+
+  const auto large_left = randomDisparityImage(rows, cols, cols / 2);
+  const auto large_right = randomDisparityImage(rows, cols, cols / 2);
+  const auto small_left = randomDisparityImage(rows / 2, cols / 2, cols / 4);
+  const auto small_right = randomDisparityImage(rows / 2, cols / 2, cols / 4);
+  auto first_batch = dispatcher.submit(large_left, large_right);
+  blocked.wait();
+  auto failing = dispatcher.submit(large_left, large_right);
+  auto switching = dispatcher.submit(small_left, small_right);
+  release.set_value();
+
+  if (first_batch.get().failed or not failing.get().failed or
+      switching.get().failed) {
+    std::cerr << "The dispatcher did not report the failure of a check "
+                 "which was pending when the resolution switched"
+              << std::endl;
+    return EXIT_FAILURE;
+  }
+  return false;
+}
+
+/* Validate the dispatcher with kernels which write each combination of the
+ * outputs, with and without macros. Returns the number of failed checks. */
+inline size_t validateDispatchers(Runtime &runtime) {
+  std::vector<KernelFeatures> all_features(3);
+  all_features[1].both_sides = false;
+  all_features[1].residuals = true;
+  all_features[2].local_memory = true;
+  all_features[2].vector_width = 4;
+  all_features[2].residuals = true;
+
+  size_t failures = 0;
+  for (const auto &features : all_features) {
+    for (const auto &with_macros : {false, true}) {
+      failures += validateDispatcher(runtime, features, with_macros);
+    }
+  }
+  return failures;
+}